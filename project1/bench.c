@@ -0,0 +1,420 @@
+/*
+ * Project 1: Graphics Library Benchmarks
+ * CS 1550 - Fall 2017
+ * Author: Zac Yu (zhy46@pitt.edu)
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "graphics.h"
+
+#define DEFAULT_FRAMES 200
+#define SEED 1550
+
+/** Fixed-seed xorshift generator so that every build sees the same work. */
+static unsigned rng_state;
+
+static unsigned next_random() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static int random_in(int lo, int hi) {
+  return lo + (int)(next_random() % (unsigned)(hi - lo + 1));
+}
+
+static color_t random_color() {
+  return RGB(next_random(), next_random(), next_random());
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** The state shared by a workload across its frames. */
+struct bench {
+  int width;
+  int height;
+  void* buffers[2];
+  void* tiled;  // A tiled buffer, for comparing the layouts.
+  line_t* lines;
+  point_t* points;
+  image_t sprite;
+  display_list_t* list;
+  int count;  // Primitives per frame.
+  long long pixels;  // Pixels touched per frame.
+};
+
+struct workload {
+  const char* name;
+  void (*setup)(struct bench* b);
+  void (*frame)(struct bench* b, int frame);
+};
+
+/** Fills the buffer with full-width lines so that clearing it is full work. */
+static void fill_buffer(struct bench* b, void* buf) {
+  int y;
+  for (y = 0; y < b->height; ++y) draw_line(buf, 0, y, b->width - 1, y, 1);
+}
+
+static void setup_clear(struct bench* b) {
+  b->count = 1;
+  b->pixels = (long long)(b->width) * b->height;
+}
+
+static void frame_clear(struct bench* b, int frame) {
+  clear_screen(b->buffers[0]);
+}
+
+static void prepare_clear(struct bench* b) {
+  fill_buffer(b, b->buffers[0]);
+  sync_graphics();
+}
+
+static void setup_blit(struct bench* b) {
+  fill_buffer(b, b->buffers[0]);
+  fill_buffer(b, b->buffers[1]);
+  b->count = 1;
+  b->pixels = (long long)(b->width) * b->height;
+}
+
+static void frame_blit(struct bench* b, int frame) {
+  // Alternating buffers makes every blit a full copy.
+  blit(b->buffers[frame & 1]);
+}
+
+/** Generates lines of the given length spread evenly over all octants. */
+static void setup_lines(struct bench* b, int count, int length) {
+  int i;
+  b->count = count;
+  b->pixels = 0;
+  b->lines = malloc(sizeof(line_t) * count);
+  for (i = 0; i < count; ++i) {
+    double angle = 2 * M_PI * (i % 8 + (next_random() % 1000) / 1000.0) / 8;
+    int dx = round(length * cos(angle));
+    int dy = round(length * sin(angle));
+    int x = random_in(dx < 0 ? -dx : 0, b->width - 1 - (dx > 0 ? dx : 0));
+    int y = random_in(dy < 0 ? -dy : 0, b->height - 1 - (dy > 0 ? dy : 0));
+    b->lines[i].x1 = x;
+    b->lines[i].y1 = y;
+    b->lines[i].x2 = x + dx;
+    b->lines[i].y2 = y + dy;
+    b->lines[i].color = random_color();
+    b->pixels += (abs(dx) > abs(dy) ? abs(dx) : abs(dy)) + 1;
+  }
+}
+
+static void setup_short_lines(struct bench* b) {
+  setup_lines(b, 4096, 8);
+}
+
+static void setup_long_lines(struct bench* b) {
+  int length = (b->width < b->height ? b->width : b->height) * 5 / 6;
+  setup_lines(b, 256, length);
+}
+
+static void draw_each_line(struct bench* b, void* img) {
+  int i;
+  for (i = 0; i < b->count; ++i) {
+    const line_t* l = &b->lines[i];
+    draw_line(img, l->x1, l->y1, l->x2, l->y2, l->color);
+  }
+}
+
+static void frame_lines(struct bench* b, int frame) {
+  draw_each_line(b, b->buffers[0]);
+}
+
+static void frame_lines_tiled(struct bench* b, int frame) {
+  draw_each_line(b, b->tiled);
+}
+
+static void frame_line_batch(struct bench* b, int frame) {
+  draw_lines(b->buffers[0], b->lines, b->count);
+  sync_graphics();
+}
+
+static void frame_line_batch_tiled(struct bench* b, int frame) {
+  draw_lines(b->tiled, b->lines, b->count);
+  sync_graphics();
+}
+
+static void setup_pixels(struct bench* b) {
+  int i;
+  b->count = 65536;
+  b->pixels = b->count;
+  b->points = malloc(sizeof(point_t) * b->count);
+  for (i = 0; i < b->count; ++i) {
+    b->points[i].x = random_in(0, b->width - 1);
+    b->points[i].y = random_in(0, b->height - 1);
+    b->points[i].color = random_color();
+  }
+}
+
+static void frame_pixels(struct bench* b, int frame) {
+  int i;
+  for (i = 0; i < b->count; ++i) {
+    const point_t* p = &b->points[i];
+    draw_pixel(b->buffers[0], p->x, p->y, p->color);
+  }
+}
+
+/** Filled circles with radii cycling through 4 to 40 pixels. */
+static void setup_circles(struct bench* b) {
+  int i;
+  b->count = 256;
+  b->pixels = 0;
+  b->points = malloc(sizeof(point_t) * b->count);
+  for (i = 0; i < b->count; ++i) {
+    int r = 4 + i % 37;
+    b->points[i].x = random_in(r, b->width - 1 - r);
+    b->points[i].y = random_in(r, b->height - 1 - r);
+    b->points[i].color = random_color();
+    b->pixels += round(M_PI * r * r);
+  }
+}
+
+static void frame_circles(struct bench* b, int frame) {
+  int i;
+  for (i = 0; i < b->count; ++i) {
+    const point_t* p = &b->points[i];
+    fill_circle(b->buffers[0], p->x, p->y, 4 + i % 37, p->color);
+  }
+}
+
+/** A 32x32 sprite with a transparent border, drawn at random positions. */
+static void setup_sprites(struct bench* b) {
+  int i;
+  setup_pixels(b);
+  b->count = 512;
+  b->pixels = b->count * 32 * 32;
+  b->sprite.width = 32;
+  b->sprite.height = 32;
+  b->sprite.color_key = 0;
+  b->sprite.pixels = malloc(sizeof(color_t) * 32 * 32);
+  for (i = 0; i < 32 * 32; ++i) {
+    int x = i % 32;
+    int y = i / 32;
+    int border = x < 4 || y < 4 || x >= 28 || y >= 28;
+    b->sprite.pixels[i] = border ? 0 : random_color() | 1;
+  }
+}
+
+static void frame_sprites(struct bench* b, int frame) {
+  int i;
+  for (i = 0; i < b->count; ++i) {
+    const point_t* p = &b->points[i];
+    draw_image(b->buffers[0], p->x - 16, p->y - 16, &b->sprite, NULL);
+  }
+}
+
+/** A translucent HUD with a bar on each edge, blended over a full scene. */
+static void setup_layers(struct bench* b) {
+  int y;
+  fill_buffer(b, b->buffers[0]);
+  for (y = 0; y < b->height; ++y) {
+    if (y < 48 || y >= b->height - 48) {
+      draw_line(b->buffers[1], 0, y, b->width - 1, y, RGB(4, 8, 20));
+    }
+  }
+  add_layer(b->buffers[1], 160);
+  b->count = 1;
+  b->pixels = (long long)(b->width) * 96;
+}
+
+static void frame_layers(struct bench* b, int frame) {
+  composite_layers(b->buffers[0]);
+}
+
+/** The radial fan drawn by driver.c, including its clear and blit. */
+static void setup_fan(struct bench* b) {
+  b->count = 180;
+  b->lines = malloc(sizeof(line_t) * b->count);
+  b->pixels = 0;
+}
+
+static void draw_fan(struct bench* b, void* img, int frame) {
+  const color_t kColors[6] = {
+    RGB(29, 0, 0), RGB(31, 35, 0), RGB(31, 59, 1),
+    RGB(0, 32, 5), RGB(1, 10, 31), RGB(15, 2, 17)
+  };
+  int radius = (b->width < b->height ? b->width : b->height) * 5 / 12;
+  int o_x = b->width / 2;
+  int o_y = b->height / 2;
+  int i;
+  b->pixels = 0;
+  for (i = 0; i < b->count; ++i) {
+    double angle = 2 * M_PI * (double) i / (double) b->count;
+    int dx = round((double) radius * sin(angle));
+    int dy = round((double) radius * cos(angle));
+    b->lines[i].x1 = o_x;
+    b->lines[i].y1 = o_y;
+    b->lines[i].x2 = o_x + dx;
+    b->lines[i].y2 = o_y + dy;
+    b->lines[i].color = kColors[((i + frame) % b->count) / (b->count / 6)];
+    b->pixels += (abs(dx) > abs(dy) ? abs(dx) : abs(dy)) + 1;
+  }
+  clear_screen(img);
+  draw_lines(img, b->lines, b->count);
+}
+
+static void frame_fan(struct bench* b, int frame) {
+  draw_fan(b, b->buffers[0], frame);
+  blit(b->buffers[0]);
+}
+
+static void frame_fan_tiled(struct bench* b, int frame) {
+  draw_fan(b, b->tiled, frame);
+  blit(b->tiled);
+}
+
+/** The same fan drawn into the swap chain and presented by its thread. */
+static void frame_fan_pipelined(struct bench* b, int frame) {
+  void* img = acquire_frame();
+  if (!img) return;
+  draw_fan(b, img, frame);
+  present_frame(img);
+}
+
+/** The fan recorded once and drawn from a display list at moving offsets. */
+static void setup_fan_list(struct bench* b) {
+  setup_fan(b);
+  draw_fan(b, b->buffers[1], 0);
+  b->list = new_display_list();
+  record_lines(b->list, b->lines, b->count);
+}
+
+static void frame_fan_list(struct bench* b, int frame) {
+  clear_screen(b->buffers[0]);
+  draw_display_list(b->buffers[0], b->list, frame % 32 - 16, frame % 16 - 8);
+  blit(b->buffers[0]);
+}
+
+static const struct workload kWorkloads[] = {
+  {"clear_screen", setup_clear, frame_clear},
+  {"blit", setup_blit, frame_blit},
+  {"short_lines", setup_short_lines, frame_lines},
+  {"short_lines_batch", setup_short_lines, frame_line_batch},
+  {"long_lines", setup_long_lines, frame_lines},
+  {"long_lines_batch", setup_long_lines, frame_line_batch},
+  {"short_lines_tiled", setup_short_lines, frame_lines_tiled},
+  {"long_lines_tiled", setup_long_lines, frame_lines_tiled},
+  {"long_lines_batch_tiled", setup_long_lines, frame_line_batch_tiled},
+  {"random_pixels", setup_pixels, frame_pixels},
+  {"filled_circles", setup_circles, frame_circles},
+  {"sprites", setup_sprites, frame_sprites},
+  {"hud_layers", setup_layers, frame_layers},
+  {"driver_fan", setup_fan, frame_fan},
+  {"driver_fan_tiled", setup_fan, frame_fan_tiled},
+  {"driver_fan_pipelined", setup_fan, frame_fan_pipelined},
+  {"driver_fan_list", setup_fan_list, frame_fan_list},
+};
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)(a);
+  double y = *(const double*)(b);
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, int n, double p) {
+  int index = (int)(ceil(p * n)) - 1;
+  if (index < 0) index = 0;
+  return sorted[index];
+}
+
+int main(int argc, char* argv[]) {
+  const char* csv_path = "bench.csv";
+  int frames = DEFAULT_FRAMES;
+  struct graphics_config config = {GRAPHICS_BACKEND_FILE, NULL, 640, 480};
+  const char* threads = getenv("GRAPHICS_THREADS");
+  const char* bpp = getenv("GRAPHICS_BPP");
+  int opt;
+  unsigned w;
+  int i;
+  while ((opt = getopt(argc, argv, "o:f:g:")) != -1) {
+    if (opt == 'o') {
+      csv_path = optarg;
+    } else if (opt == 'f') {
+      frames = atoi(optarg);
+    } else if (opt == 'g') {
+      sscanf(optarg, "%dx%d", &config.width, &config.height);
+    } else {
+      fprintf(stderr, "Usage: bench [-o out.csv] [-f frames] [-g WxH]\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (frames < 1) frames = 1;
+  if (threads) config.threads = atoi(threads);
+  config.bits_per_pixel = bpp ? atoi(bpp) : 16;
+  config.capture_path = getenv("GRAPHICS_CAPTURE");
+  init_graphics_with(&config);
+  struct bench b = {config.width, config.height};
+  b.buffers[0] = new_offscreen_buffer();
+  b.buffers[1] = new_offscreen_buffer();
+  b.tiled = new_tiled_offscreen_buffer();
+  if (!b.buffers[0] || !b.buffers[1] || !b.tiled) {
+    fprintf(stderr, "Failed to initialize the graphics library.\n");
+    return EXIT_FAILURE;
+  }
+  FILE* csv = fopen(csv_path, "w");
+  if (!csv) {
+    perror(csv_path);
+    return EXIT_FAILURE;
+  }
+  fprintf(csv, "workload,width,height,bpp,threads,frames,"
+          "primitives_per_frame,mpixels_per_s,ns_per_primitive,"
+          "p50_frame_us,p99_frame_us\n");
+  printf("%-22s %12s %12s %12s %12s\n", "workload", "Mpixel/s", "ns/prim",
+         "p50 us", "p99 us");
+  double* times = malloc(sizeof(double) * frames);
+  for (w = 0; w < sizeof(kWorkloads) / sizeof(kWorkloads[0]); ++w) {
+    const struct workload* wl = &kWorkloads[w];
+    rng_state = SEED;
+    clear_screen(b.buffers[0]);
+    clear_screen(b.buffers[1]);
+    clear_screen(b.tiled);
+    wl->setup(&b);
+    double total = 0;
+    long long pixels = 0;
+    for (i = 0; i < frames; ++i) {
+      if (wl->frame == frame_clear) prepare_clear(&b);
+      double start = now_ns();
+      wl->frame(&b, i);
+      times[i] = now_ns() - start;
+      total += times[i];
+      pixels += b.pixels;
+    }
+    drop_layer(b.buffers[1]);
+    qsort(times, frames, sizeof(double), compare_doubles);
+    double mpixels = pixels / (total / 1e9) / 1e6;
+    double ns_per_prim = total / ((double)(b.count) * frames);
+    double p50 = percentile(times, frames, 0.5) / 1e3;
+    double p99 = percentile(times, frames, 0.99) / 1e3;
+    printf("%-22s %12.1f %12.1f %12.1f %12.1f\n", wl->name, mpixels,
+           ns_per_prim, p50, p99);
+    fprintf(csv, "%s,%d,%d,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f\n", wl->name,
+            b.width, b.height, config.bits_per_pixel, config.threads, frames,
+            b.count, mpixels, ns_per_prim, p50, p99);
+    free(b.lines);
+    free(b.points);
+    free(b.sprite.pixels);
+    free_display_list(b.list);
+    b.lines = NULL;
+    b.points = NULL;
+    b.sprite.pixels = NULL;
+    b.list = NULL;
+  }
+  free(times);
+  fclose(csv);
+  exit_graphics();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+/*
+ * Project 1: Graphics Library Capture Converter
+ * CS 1550 - Fall 2017
+ * Author: Zac Yu (zhy46@pitt.edu)
+ *
+ * Converts a capture written by start_capture() to one binary PPM image per
+ * frame, named <prefix>00000.ppm and so on.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILL 0x80000000u
+
+static uint64_t get_le(const uint8_t* p, int size) {
+  uint64_t value = 0;
+  while (size-- > 0) value = value << 8 | p[size];
+  return value;
+}
+
+/** The capture header, see start_capture() in graphics.h. */
+struct capture {
+  uint32_t line_length;
+  uint32_t lines;
+  uint32_t width;
+  int bytes_per_pixel;
+  int offset[3];  // Red, green and blue.
+  int length[3];
+};
+
+static int read_header(FILE* in, struct capture* c) {
+  uint8_t header[28];
+  int i;
+  if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+      memcmp(header, "GCAP", 4) != 0 || get_le(header + 4, 4) != 1) {
+    return -1;
+  }
+  c->line_length = get_le(header + 8, 4);
+  c->lines = get_le(header + 12, 4);
+  c->width = get_le(header + 16, 4);
+  c->bytes_per_pixel = header[20];
+  for (i = 0; i < 3; ++i) {
+    c->offset[i] = header[21 + i * 2];
+    c->length[i] = header[22 + i * 2];
+  }
+  if (c->bytes_per_pixel < 2 || c->bytes_per_pixel > 4 ||
+      c->width > c->line_length) {
+    return -1;
+  }
+  return 0;
+}
+
+/** Applies the runs of the next frame, returning 0 at the end of the file. */
+static int read_frame(FILE* in, const struct capture* c, uint8_t* frame) {
+  const size_t pixels = (size_t)(c->line_length) * c->lines;
+  const int size = c->bytes_per_pixel;
+  uint8_t header[16];
+  uint32_t runs;
+  size_t n = fread(header, 1, sizeof(header), in);
+  if (n == 0) return 0;
+  if (n != sizeof(header) || memcmp(header, "FRME", 4) != 0) return -1;
+  for (runs = get_le(header + 12, 4); runs > 0; --runs) {
+    uint8_t run[8];
+    if (fread(run, 1, sizeof(run), in) != sizeof(run)) return -1;
+    size_t offset = get_le(run, 4);
+    uint32_t count = get_le(run + 4, 4);
+    int fill = (count & FILL) != 0;
+    count &= ~FILL;
+    if (offset > pixels || count > pixels - offset) return -1;
+    uint8_t* p = frame + offset * size;
+    if (fread(p, size, fill ? 1 : count, in) != (fill ? 1 : count)) return -1;
+    if (!fill) continue;
+    uint32_t i;
+    for (i = 1; i < count; ++i) memcpy(p + i * size, p, size);
+  }
+  return 1;
+}
+
+/** Scales a channel to 8 bits. */
+static uint8_t channel(uint32_t pixel, int offset, int length) {
+  uint32_t max = (1u << length) - 1;
+  if (length == 0) return 0;
+  return (((pixel >> offset) & max) * 255 + max / 2) / max;
+}
+
+static int write_ppm(const char* path, const struct capture* c,
+                     const uint8_t* frame) {
+  FILE* out = fopen(path, "wb");
+  uint8_t* row = malloc(c->width * 3 + 1);
+  uint32_t x;
+  uint32_t y;
+  int i;
+  if (!out || !row) {
+    if (out) fclose(out);
+    free(row);
+    return -1;
+  }
+  fprintf(out, "P6\n%u %u\n255\n", c->width, c->lines);
+  for (y = 0; y < c->lines; ++y) {
+    const uint8_t* p = frame + (size_t)(y) * c->line_length *
+        c->bytes_per_pixel;
+    for (x = 0; x < c->width; ++x, p += c->bytes_per_pixel) {
+      uint32_t pixel = get_le(p, c->bytes_per_pixel);
+      for (i = 0; i < 3; ++i) {
+        row[x * 3 + i] = channel(pixel, c->offset[i], c->length[i]);
+      }
+    }
+    fwrite(row, 3, c->width, out);
+  }
+  free(row);
+  return fclose(out) == 0 ? 0 : -1;
+}
+
+int main(int argc, char** argv) {
+  struct capture c;
+  char path[4096];
+  int frames = 0;
+  int status;
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: capture2ppm capture [prefix]\n");
+    return EXIT_FAILURE;
+  }
+  const char* prefix = argc == 3 ? argv[2] : "frame";
+  FILE* in = fopen(argv[1], "rb");
+  if (!in) {
+    perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+  if (read_header(in, &c) != 0) {
+    fprintf(stderr, "%s: not a graphics capture\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  uint8_t* frame = calloc((size_t)(c.line_length) * c.lines,
+                          c.bytes_per_pixel);
+  if (!frame) return EXIT_FAILURE;
+  while ((status = read_frame(in, &c, frame)) > 0) {
+    snprintf(path, sizeof(path), "%s%05d.ppm", prefix, frames++);
+    if (write_ppm(path, &c, frame) != 0) {
+      perror(path);
+      return EXIT_FAILURE;
+    }
+  }
+  if (status < 0) {
+    fprintf(stderr, "%s: truncated after %d frames\n", argv[1], frames);
+  }
+  printf("%d frames\n", frames);
+  free(frame);
+  fclose(in);
+  return status < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -23,6 +23,7 @@ int main() {
   };
   const int kLineNum = 180;
   const int kSizeAdjustStep = 5;
+  const int kAnimationFps = 20;
   const char kWelcomeText[] =
       "\033[1;1HGraphics Library Driver\n"
       "Author: Zac Yu (zhy46@)\n"
@@ -34,6 +35,7 @@ int main() {
   getkey();
   write(STDOUT_FILENO, "\033[1;1H \033[1;1H", 13);
   void* fb = new_offscreen_buffer();
+  line_t lines[kLineNum];
 
   bool animation_mode = false;
   int i;
@@ -42,6 +44,8 @@ int main() {
   int o_y = 240;
   int offset = 0;
   char op;
+  frame_scheduler_t frames;
+  key_event_t event;
 
   while (true) {
     offset = (offset + kLineNum) % kLineNum;
@@ -50,15 +54,26 @@ int main() {
                                       (double) kLineNum));
       double y_end_offset = round((double) radius * cos(2 * M_PI * (double) i /
                                       (double) kLineNum));
-      draw_line(fb, o_x, o_y, o_x + x_end_offset, o_y + y_end_offset,
-                kColors[((i + offset) % kLineNum) / (kLineNum / 6)]);
+      lines[i].x1 = o_x;
+      lines[i].y1 = o_y;
+      lines[i].x2 = o_x + x_end_offset;
+      lines[i].y2 = o_y + y_end_offset;
+      lines[i].color = kColors[((i + offset) % kLineNum) / (kLineNum / 6)];
     }
+    draw_lines(fb, lines, kLineNum);
     blit(fb);
     if (animation_mode) {
       if (radius > 1) {
         radius--;
         offset++;
-        sleep_ms(50);
+        // Keep reading keys until the next frame is due.
+        if (poll_events(&event, 1, frames.deadline_ns) > 0 &&
+            event.key == 'q') {
+          clear_screen(fb);
+          blit(fb);
+          break;
+        }
+        wait_next_frame(&frames);
       } else {
         animation_mode = false;
         clear_screen(fb);
@@ -82,6 +97,7 @@ int main() {
           radius = 50;
         }
         animation_mode = true;
+        start_frame_scheduler(&frames, kAnimationFps);
       } else if (op == 'r') {
         radius = 200;
         offset = 0;
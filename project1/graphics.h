@@ -6,26 +6,340 @@
 #ifndef ZHY46_CS1550_PROJECT1_GRAPHICS_LIBRARY_H_
 #define ZHY46_CS1550_PROJECT1_GRAPHICS_LIBRARY_H_
 
+/*
+ * Colors are RGB565 values. They are converted to the pixel format of the
+ * framebuffer (16, 24 or 32 bits per pixel) once per primitive.
+ */
 typedef unsigned short int color_t;
 
+/* A line segment with its own color, for draw_lines(). */
+typedef struct {
+  int x1;
+  int y1;
+  int x2;
+  int y2;
+  color_t color;
+} line_t;
+
+/* A pixel with its own color, for draw_pixels(). */
+typedef struct {
+  int x;
+  int y;
+  color_t color;
+} point_t;
+
+/* A polygon vertex for fill_polygon(). */
+typedef struct {
+  int x;
+  int y;
+} vertex_t;
+
+/* A rectangle of pixels, from its top-left corner. */
+typedef struct {
+  int x;
+  int y;
+  int width;
+  int height;
+} rect_t;
+
+#define NO_COLOR_KEY (-1)
+
+/* An RGB565 image in memory, with rows stored top to bottom. */
+typedef struct {
+  int width;
+  int height;
+  int color_key;  /* Color left transparent when drawn, or NO_COLOR_KEY. */
+  color_t* pixels;
+} image_t;
+
+/* Flags for load_image(). */
+#define IMAGE_DITHER 1  /* Ordered dithering when reducing to RGB565. */
+
+/* Recorded primitives, see new_display_list(). */
+typedef struct display_list display_list_t;
+
+/* A key press read from standard input. */
+typedef struct {
+  char key;
+  long long timestamp_ns;  /* graphics_clock_ns() when the key was read. */
+} key_event_t;
+
+/* Paces a loop to a fixed frame rate with absolute deadlines. */
+typedef struct {
+  long long period_ns;
+  long long deadline_ns;  /* When the next frame is due. */
+  long missed;  /* Deadlines missed since the scheduler was started. */
+} frame_scheduler_t;
+
 #define RGB(R, G, B) (((R & 0x1F) << 11) | ((G & 0x3F) << 5) | (B & 0x1F))
 
+/* Where the screen lives. */
+typedef enum {
+  GRAPHICS_BACKEND_FBDEV,  /* A Linux framebuffer device. */
+  GRAPHICS_BACKEND_FILE,  /* A mapped file, for running without a display. */
+  /* Truecolor half blocks on standard output, e.g. over SSH. Two pixels
+     per character cell; a zero width or height fills the window. */
+  GRAPHICS_BACKEND_TERMINAL
+} graphics_backend_t;
+
+struct graphics_config {
+  graphics_backend_t backend;
+  const char* path;  /* Device or backing file; NULL for the default. */
+  int width;  /* Geometry of the file and terminal backends. */
+  int height;
+  int virtual_height;  /* Room for page flipping, at least height. */
+  int bits_per_pixel;  /* Zero for the default of 16. */
+  int threads;  /* Rasterizer threads; zero or one draws on the caller. */
+  int stats;  /* 1 collects graphics_stats, 2 also prints them at exit. */
+  int max_queued_frames;  /* See set_max_queued_frames(); zero for 1. */
+  const char* capture_path;  /* Captures every frame there if not NULL. */
+};
+
+#define GRAPHICS_STATS_BUCKETS 24
+
+/* Counters collected when stats are enabled in the configuration. */
+struct graphics_stats {
+  unsigned long long frames;  /* Calls to blit(). */
+  unsigned long long clears;
+  unsigned long long clear_ns;
+  unsigned long long draw_calls;  /* Calls to draw_line(s)/draw_pixels(). */
+  unsigned long long primitives;
+  unsigned long long pixels;  /* Pixels written by drawing. */
+  unsigned long long draw_ns;  /* Time spent in the calling thread. */
+  unsigned long long bytes_blitted;
+  unsigned long long blit_ns;
+  unsigned long long frames_queued;  /* Calls to present_frame(). */
+  /* Sum of the queue depth after each present_frame(), for the mean. */
+  unsigned long long queue_depth_sum;
+  /* Time the caller waited for a free buffer or room in the queue. */
+  unsigned long long queue_wait_ns;
+  unsigned long long capture_bytes;  /* Written by frame capture. */
+  unsigned long long capture_ns;
+  unsigned long long terminal_bytes;  /* Sent by the terminal backend. */
+  /* frame_histogram[i] counts frame intervals below 2^(i+1) microseconds. */
+  unsigned long long frame_histogram[GRAPHICS_STATS_BUCKETS];
+  /* Summary of the most recent frame-to-frame intervals. */
+  unsigned long long frame_p50_ns;
+  unsigned long long frame_p99_ns;
+  unsigned long long frame_max_ns;
+};
+
+/*
+ * Initializes the library from the GRAPHICS_* environment variables, using
+ * /dev/fb0 when none are set.
+ */
 void init_graphics();
 
+void init_graphics_with(const struct graphics_config* config);
+
 void exit_graphics();
 
 char getkey();
 
 void sleep_ms(long ms);
 
+/* Monotonic time in nanoseconds, the clock used by events and frames. */
+long long graphics_clock_ns();
+
+/*
+ * Stores up to max queued key events in events, waiting for one until the
+ * absolute deadline_ns. A deadline in the past polls without waiting, and a
+ * negative deadline waits forever. Returns the number of events stored.
+ */
+int poll_events(key_event_t* events, int max, long long deadline_ns);
+
+void start_frame_scheduler(frame_scheduler_t* scheduler, int fps);
+
+/*
+ * Sleeps until the next frame is due. Returns the number of frame deadlines
+ * that had already passed and were skipped, which is also added to missed.
+ */
+int wait_next_frame(frame_scheduler_t* scheduler);
+
 void clear_screen(void* img);
 
 void draw_pixel(void* img, int x, int y, color_t color);
 
 void draw_line(void* img, int x1, int y1, int x2, int y2, color_t c);
 
+/*
+ * Draws a batch of primitives. This is equivalent to calling draw_line() or
+ * draw_pixel() on each element, but the per-call checks are done once and the
+ * primitives are drawn grouped by screen band for better cache locality, so
+ * the color of a pixel covered by several primitives of a batch may come from
+ * any of them.
+ */
+void draw_lines(void* img, const line_t* lines, int count);
+
+void draw_pixels(void* img, const point_t* points, int count);
+
+/*
+ * Waits until all queued drawing has landed in its buffers. Only needed
+ * before reading a buffer directly; the library calls it before blit().
+ */
+void sync_graphics();
+
+/*
+ * Circles and ellipses are rasterized with integer midpoint algorithms, and
+ * the filled shapes are drawn as one horizontal span per scanline.
+ */
+void draw_circle(void* img, int cx, int cy, int r, color_t c);
+
+void fill_circle(void* img, int cx, int cy, int r, color_t c);
+
+void draw_ellipse(void* img, int cx, int cy, int rx, int ry, color_t c);
+
+void fill_ellipse(void* img, int cx, int cy, int rx, int ry, color_t c);
+
+/*
+ * Fills a simple or self-intersecting polygon with the even-odd rule. A pixel
+ * is inside when its top-left corner is, so adjacent polygons sharing an edge
+ * do not overlap.
+ */
+void fill_polygon(void* img, const vertex_t* vertices, int count, color_t c);
+
+/*
+ * A display list records primitives once, converted to the pixel format and
+ * clipped to the screen, for static content that is drawn every frame. It is
+ * rasterized into a cache the first time it is drawn after a change, and then
+ * drawn by copying what the cache covers, at any translation. Recording
+ * requires the library to be initialized.
+ */
+display_list_t* new_display_list();
+
+void free_display_list(display_list_t* list);
+
+/* Removes every recorded primitive. */
+void reset_display_list(display_list_t* list);
+
+void record_pixel(display_list_t* list, int x, int y, color_t c);
+
+void record_line(display_list_t* list, int x1, int y1, int x2, int y2,
+                 color_t c);
+
+void record_lines(display_list_t* list, const line_t* lines, int count);
+
+/*
+ * Draws a display list moved by (dx, dy), clipped to the screen. Returns -1
+ * if there is no memory for the cache and the list is moved, else 0.
+ */
+int draw_display_list(void* img, display_list_t* list, int dx, int dy);
+
+/*
+ * Offscreen buffers come from a pool of pre-faulted buffers. A freed buffer
+ * goes back to the pool; exit_graphics() releases all of them.
+ */
 void* new_offscreen_buffer();
 
+/*
+ * Allocates an offscreen buffer stored as 8x8 pixel tiles instead of
+ * scanlines, so that steep lines touch fewer cache lines and pages. Lines,
+ * pixels, shapes and clear_screen() draw into it as usual, and blit() copies
+ * it to the screen scanline by scanline. Images, blit_rect(), layers and
+ * display lists do not accept it. Free it with free_offscreen_buffer().
+ */
+void* new_tiled_offscreen_buffer();
+
+void free_offscreen_buffer(void* img);
+
 void blit(void *src);
 
+/*
+ * Loads a binary PPM (P6) or an uncompressed 24 or 32-bit BMP, converting it
+ * to RGB565. Returns NULL if the file cannot be read or parsed.
+ */
+image_t* load_image(const char* path, int flags);
+
+void free_image(image_t* image);
+
+/*
+ * Copies a rectangle of the src buffer (all of it if src_rect is NULL) to
+ * (x, y) in dst, skipping pixels of color_key unless it is NO_COLOR_KEY. Both
+ * are offscreen buffers, or the same one.
+ */
+void blit_rect(void* dst, int x, int y, const void* src,
+               const rect_t* src_rect, int color_key);
+
+/* Draws a rectangle of an image at (x, y), honoring its color key. */
+void draw_image(void* img, int x, int y, const image_t* image,
+                const rect_t* src_rect);
+
+/*
+ * Returns the buffer to draw the next frame into. When the framebuffer is tall
+ * enough to hold several screens, this is a hidden page of video memory and
+ * blit() presents it by panning the display (page flipping) instead of
+ * copying. Otherwise it is an offscreen buffer that blit() copies.
+ */
+void* get_back_buffer();
+
+/* Enables waiting for the vertical retrace before each page flip. */
+void set_vsync(int enabled);
+
+/*
+ * A triple-buffered swap chain presented by a separate thread, so that the
+ * next frame can be drawn while the previous one is copied or flipped.
+ * acquire_frame() returns a buffer of the chain to draw into, waiting until
+ * one is free, and present_frame() queues it and returns. The chain uses
+ * pages of video memory when there are three of them. acquire_frame()
+ * returns NULL if every buffer is already acquired.
+ */
+void* acquire_frame();
+
+void present_frame(void* img);
+
+/* The number of frames queued or being presented. */
+int get_present_queue_depth();
+
+/*
+ * Limits how many frames present_frame() may queue before it waits: 1 keeps
+ * the latency to a frame, 2 lets the caller run further ahead for throughput.
+ */
+void set_max_queued_frames(int frames);
+
+/*
+ * Layers are offscreen buffers blended over the back buffer by
+ * composite_layers(), from the first added to the last. Pixels of the color
+ * key are transparent. It is 0 unless changed, so what was not drawn since
+ * the layer was last cleared is transparent; with NO_COLOR_KEY every pixel is
+ * blended. The others are blended with the layer alpha (0 to 255), scaled by
+ * the per-pixel alpha plane if the layer has one. Fully transparent 16x16
+ * tiles are skipped. Adding a layer again moves it to the top.
+ */
+int add_layer(void* img, int alpha);
+
+void drop_layer(void* img);
+
+void set_layer_alpha(void* img, int alpha);
+
+void set_layer_color_key(void* img, int color_key);
+
+/*
+ * Returns the per-pixel alpha of a layer, one byte per pixel and line_length
+ * bytes per row, creating it fully transparent on the first call.
+ */
+unsigned char* get_layer_alpha_plane(void* img);
+
+void composite_layers(void* dst);
+
+/*
+ * Records every presented frame to a file, as the runs of pixels that changed
+ * since the previous frame. capture2ppm converts a capture to PPM images.
+ * All numbers are little-endian. The file starts with a 28-byte header:
+ *   "GCAP", version 1, pixels per scanline, scanlines, visible width (u32),
+ *   bytes per pixel, then the offset and length of red, green and blue, and
+ *   a padding byte (u8).
+ * Every frame is "FRME", a graphics_clock_ns() timestamp (u64) and a run
+ * count (u32), followed by the runs. A run is the pixel offset in the frame
+ * and the pixel count (u32 each). If the top bit of the count is set, one
+ * pixel follows and fills the run; otherwise count pixels follow. Frames
+ * start from an all-zero screen. Returns -1 if the file cannot be written.
+ */
+int start_capture(const char* path);
+
+void stop_capture();
+
+void get_graphics_stats(struct graphics_stats* stats);
+
+void reset_graphics_stats();
+
 #endif  // ZHY46_CS1550_PROJECT1_GRAPHICS_LIBRARY_H_
@@ -4,8 +4,17 @@
  * Author: Zac Yu (zhy46@pitt.edu)
  */
 
+#define _GNU_SOURCE  // For memfd_create().
+
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/fb.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/select.h>
@@ -15,139 +24,3935 @@
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
 #include "graphics.h"
 
 #define CLEAR_SCREEN_SEQ "\033[2J"
+#define MAX_BUFFERS 64
+#define MAX_PAGES 3
+#define MAX_EVENTS 64
+#define MAX_POOLED 8  // Freed offscreen buffers kept for reuse.
+#define FRAME_RING_SIZE 1024  // Most recent frame intervals kept for stats.
+#define HUGE_PAGE_SIZE (2 << 20)
+#define BAND_SHIFT 5  // Batched primitives are grouped in bands of 32 lines.
+#define MAX_WORKERS 16
+#define MAX_JOBS 8  // Batches that can be queued for the workers at once.
+#define MAX_LAYERS 8
+#define CHAIN_LENGTH 3  // Buffers in the swap chain of present_frame().
+#define TILE_SHIFT 4  // Layers are composited in tiles of 16x16 pixels.
+#define TILED_SHIFT 3  // Tiled buffers store tiles of 8x8 pixels.
 
 typedef enum { false, true } bool;
 
 static bool initialized = false;
 static int fb;
-static void* fb_mem;
-static int fb_size;
+static void* fb_mem;  // Mapping of the whole virtual framebuffer.
+static int fb_map_size;
+static void* screen_mem;  // The visible part of the framebuffer.
+static int fb_size;  // Size of the visible screen and of every buffer.
 static int line_count;
-static int line_length;
+static int line_length;  // Pixels per scanline, including any padding.
+static int stride;  // Bytes per scanline.
+static int bytes_per_pixel;
+static int tiles_per_row;  // Tile columns of a tiled buffer.
+static size_t tiled_size;  // Bytes of a tiled buffer, in whole tiles.
 
-void init_graphics() {
-  struct fb_fix_screeninfo fsinfo;
-  struct fb_var_screeninfo vsinfo;
-  struct termios tios;
+// Page flipping state. The virtual framebuffer is split into pages of the
+// visible height, and blit() pans the display to a page instead of copying.
+static struct fb_var_screeninfo var_info;
+static int initial_yoffset;
+static void* pages[MAX_PAGES];
+static int page_count;  // Zero when page flipping is unavailable.
+static int shown_page;
+static bool vsync_enabled = false;
+static void* fallback_back_buffer;  // Used when pages are unavailable.
 
-  fb = open("/dev/fb0", O_RDWR);
-  if (fb == -1) return;
-  if (ioctl(fb, FBIOGET_FSCREENINFO, &fsinfo) == -1) return;
-  if (ioctl(fb, FBIOGET_VSCREENINFO, &vsinfo) == -1) return;
-  line_count = vsinfo.yres_virtual;
-  line_length = fsinfo.line_length / 2;
-  fb_size = line_count * line_length * 2;
-  fb_mem = mmap(NULL, fb_size, PROT_READ | PROT_WRITE, MAP_SHARED, fb, 0);
-  if (fb_mem == MAP_FAILED) return;
-  write(STDOUT_FILENO, CLEAR_SCREEN_SEQ, 4);
-  if (ioctl(STDIN_FILENO, TCGETS, &tios) == -1) return;
-  tios.c_lflag &= ~(ICANON | ECHO);
-  if (ioctl(STDIN_FILENO, TCSETS, &tios) == -1) return;
-  initialized = true;
+static void start_workers(int count);
+static void stop_workers();
+static void render_sync();
+static void dump_stats();
+static void drop_layers();
+static void stop_present_thread();
+
+// Instrumentation, collected only when enabled in the configuration. The
+// counters are updated with relaxed atomic adds since the rasterizer threads
+// contribute to them, and frame intervals go to a lock-free ring.
+static int stats_mode;  // 0 is off, 1 collects, 2 also dumps at exit.
+static struct graphics_stats stats;
+static unsigned long long frame_ring[FRAME_RING_SIZE];
+static unsigned frame_ring_next;
+static long long last_frame_ns;
+
+#define STATS_ADD(counter, value)                                             \
+  do {                                                                        \
+    if (stats_mode) {                                                         \
+      __atomic_fetch_add(&stats.counter, (value), __ATOMIC_RELAXED);          \
+    }                                                                         \
+  } while (0)
+
+/** Returns the start time of a timed section, or zero when not collecting. */
+static long long stats_start() {
+  return stats_mode ? graphics_clock_ns() : 0;
 }
 
-void exit_graphics() {
-  struct termios tios;
+#define STATS_TIME(counter, start) \
+  STATS_ADD(counter, graphics_clock_ns() - (start))
 
-  if (!initialized) return;
-  if (munmap(fb_mem, fb_size) == -1) return;
-  if (close(fb) == -1) return;
-  if (ioctl(STDIN_FILENO, TCGETS, &tios) == -1) return;
-  tios.c_lflag |= (ICANON | ECHO);
-  if (ioctl(STDIN_FILENO, TCSETS, &tios) == -1) return;
-  initialized = false;
+/**
+ * The byte layout of an RGB888 source pixel: its size and the position of
+ * each channel in it. The conversion kernels shuffle by these offsets.
+ */
+struct rgb_layout {
+  int step;
+  int red;
+  int green;
+  int blue;
+};
+
+// Memory kernels selected by init_graphics() according to the CPU features.
+static void (*zero_kernel)(void* dst, size_t n);
+static void (*copy_kernel)(void* dst, const void* src, size_t n);
+// Fills n bytes with a repeated 32-bit pattern, where dst is aligned to the
+// pixel size so that the pattern stays in phase.
+static void (*fill_kernel)(void* dst, uint32_t pattern, size_t n);
+// Copies count pixels of the given size, skipping those equal to key.
+static void (*keyed_kernel)(char* dst, const char* src, int count, int size,
+                            uint32_t key);
+// Returns the length of the common prefix of two byte ranges.
+static size_t (*mismatch_kernel)(const char* a, const char* b, size_t n);
+// Blends count RGB565 pixels of src over dst, see blend_portable().
+static void (*blend_kernel)(uint16_t* dst, const uint16_t* src,
+                            const uint8_t* alpha, int scale, int key,
+                            int count);
+// Converts a row of 24 or 32-bit RGB pixels to RGB565, see struct rgb_layout.
+static void (*convert_kernel)(color_t* dst, const uint8_t* src, int count,
+                              const struct rgb_layout* layout,
+                              const uint8_t* dither);
+
+static void zero_portable(void* dst, size_t n) {
+  memset(dst, 0, n);
 }
 
-char getkey() {
-  fd_set fds;
-  FD_ZERO(&fds);
-  FD_SET(STDIN_FILENO, &fds);
-  char key;
-  if (select(STDIN_FILENO + 1, &fds, NULL, NULL, NULL) > 0 &&
-      read(STDIN_FILENO, &key, 1) > 0) {
-    return key;
-  }
-  return 0;
+static void copy_portable(void* dst, const void* src, size_t n) {
+  memcpy(dst, src, n);
 }
 
-void sleep_ms(long ms) {
-  struct timespec sleep_time = {ms / 1000, (ms % 1000) * 1000000};
-  nanosleep(&sleep_time, NULL);
+/** Writes the bytes of a pattern in memory order, starting at a byte phase. */
+static void fill_bytes(char* dst, uint32_t pattern, size_t phase, size_t n) {
+  const char* bytes = (const char*)(&pattern);
+  size_t i;
+  for (i = 0; i < n; ++i) dst[i] = bytes[(phase + i) & 3];
 }
 
-void clear_screen(void* img) {
+/** Rotates a pattern so that it starts at the given byte phase. */
+static uint32_t rotate_pattern(uint32_t pattern, size_t phase) {
+  char bytes[4];
   size_t i;
-  for (i = 0; i < fb_size; ++i) {
-    *((char*)(img) + i) = 0;
+  for (i = 0; i < 4; ++i) bytes[i] = ((const char*)(&pattern))[(phase + i) & 3];
+  memcpy(&pattern, bytes, 4);
+  return pattern;
+}
+
+static void fill_portable(void* dst, uint32_t pattern, size_t n) {
+  size_t head = (-(size_t)(dst)) & 7;
+  if (head > n) head = n;
+  fill_bytes(dst, pattern, 0, head);
+  uint32_t body = rotate_pattern(pattern, head);
+  uint64_t wide = ((uint64_t)(body) << 32) | body;
+  uint64_t* p = (uint64_t*)((char*)(dst) + head);
+  uint64_t* end = p + (n - head) / 8;
+  while (p < end) *p++ = wide;
+  fill_bytes((char*)(p), body, 0, (char*)(dst) + n - (char*)(p));
+}
+
+static size_t mismatch_portable(const char* a, const char* b, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t x;
+    uint64_t y;
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    if (x != y) break;
   }
+  while (i < n && a[i] == b[i]) ++i;
+  return i;
 }
 
-void draw_pixel(void* img, int x, int y, color_t color) {
-  if (!initialized) return;
-  if (x < 0 || y < 0 || x >= line_length || y >= line_count) {
-    // Illegal location.
+static void keyed_portable(char* dst, const char* src, int count, int size,
+                           uint32_t key) {
+  int i;
+  for (i = 0; i < count; ++i, dst += size, src += size) {
+    uint32_t pixel = 0;
+    memcpy(&pixel, src, size);
+    if (pixel != key) memcpy(dst, src, size);
+  }
+}
+
+/** Blends two RGB565 pixels by channel, with alpha from 0 to 256. */
+static uint16_t blend_565(uint16_t dst, uint16_t src, int alpha) {
+  int r = ((src >> 11) * alpha + (dst >> 11) * (256 - alpha) + 128) >> 8;
+  int g = (((src >> 5) & 0x3F) * alpha + ((dst >> 5) & 0x3F) * (256 - alpha) +
+           128) >> 8;
+  int b = ((src & 0x1F) * alpha + (dst & 0x1F) * (256 - alpha) + 128) >> 8;
+  return r << 11 | g << 5 | b;
+}
+
+/**
+ * The alpha of a pixel is alpha[i] if there is a per-pixel plane, widened to
+ * 0-256 and scaled by scale / 256, or scale alone otherwise. Pixels equal to
+ * key are transparent unless it is NO_COLOR_KEY.
+ */
+static inline int pixel_alpha(const uint8_t* alpha, int i, int scale) {
+  if (!alpha) return scale;
+  int a = alpha[i] + (alpha[i] >> 7);
+  return scale == 256 ? a : (a * scale) >> 8;
+}
+
+static void blend_portable(uint16_t* dst, const uint16_t* src,
+                           const uint8_t* alpha, int scale, int key,
+                           int count) {
+  int i;
+  for (i = 0; i < count; ++i) {
+    if (src[i] == key) continue;
+    dst[i] = blend_565(dst[i], src[i], pixel_alpha(alpha, i, scale));
+  }
+}
+
+/**
+ * Packs one pixel to RGB565. The dither thresholds, if any, are added to the
+ * 8-bit channels with saturation before they are truncated.
+ */
+static color_t pack_rgb565(const uint8_t* src, const struct rgb_layout* layout,
+                           const uint8_t* dither) {
+  int r = src[layout->red];
+  int g = src[layout->green];
+  int b = src[layout->blue];
+  if (dither) {
+    r = r + dither[2] > 255 ? 255 : r + dither[2];
+    g = g + dither[1] > 255 ? 255 : g + dither[1];
+    b = b + dither[0] > 255 ? 255 : b + dither[0];
+  }
+  return (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+}
+
+/**
+ * The dither argument of the conversion kernels is a row of the threshold
+ * matrix as 16 bytes: blue, green, red and padding for each of 4 pixels, the
+ * way the SIMD kernels lay out a pixel in a 32-bit lane. The row starts at
+ * x = 0, and the kernels keep every vector at a multiple of 4 pixels.
+ */
+static void convert_portable(color_t* dst, const uint8_t* src, int count,
+                             const struct rgb_layout* layout,
+                             const uint8_t* dither) {
+  int i;
+  for (i = 0; i < count; ++i, src += layout->step) {
+    dst[i] = pack_rgb565(src, layout, dither ? dither + (i & 3) * 4 : NULL);
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * The SIMD kernels handle an unaligned head and tail with memset/memcpy and
+ * run the aligned body with full-width vector stores. Zeroing targets the
+ * offscreen buffers, which are read back by the CPU shortly after, so it uses
+ * regular stores; copying targets the write-combined framebuffer mapping and
+ * therefore uses non-temporal stores that bypass the cache.
+ */
+static inline size_t align_head(const void* dst, size_t n, size_t width) {
+  size_t head = (-(size_t)(dst)) & (width - 1);
+  return head > n ? n : head;
+}
+
+__attribute__((target("sse2")))
+static void zero_sse2(void* dst, size_t n) {
+  size_t head = align_head(dst, n, 16);
+  memset(dst, 0, head);
+  char* p = (char*)(dst) + head;
+  char* end = p + ((n - head) & ~(size_t)(63));
+  const __m128i zero = _mm_setzero_si128();
+  for (; p < end; p += 64) {
+    _mm_store_si128((__m128i*)(p), zero);
+    _mm_store_si128((__m128i*)(p + 16), zero);
+    _mm_store_si128((__m128i*)(p + 32), zero);
+    _mm_store_si128((__m128i*)(p + 48), zero);
+  }
+  memset(p, 0, (char*)(dst) + n - p);
+}
+
+__attribute__((target("sse2")))
+static void copy_sse2(void* dst, const void* src, size_t n) {
+  size_t head = align_head(dst, n, 16);
+  memcpy(dst, src, head);
+  char* d = (char*)(dst) + head;
+  const char* s = (const char*)(src) + head;
+  char* end = d + ((n - head) & ~(size_t)(63));
+  for (; d < end; d += 64, s += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(s));
+    __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+    __m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+    _mm_stream_si128((__m128i*)(d), a);
+    _mm_stream_si128((__m128i*)(d + 16), b);
+    _mm_stream_si128((__m128i*)(d + 32), c);
+    _mm_stream_si128((__m128i*)(d + 48), e);
+  }
+  _mm_sfence();
+  memcpy(d, s, (char*)(dst) + n - d);
+}
+
+__attribute__((target("avx2")))
+static void zero_avx2(void* dst, size_t n) {
+  size_t head = align_head(dst, n, 32);
+  memset(dst, 0, head);
+  char* p = (char*)(dst) + head;
+  char* end = p + ((n - head) & ~(size_t)(127));
+  const __m256i zero = _mm256_setzero_si256();
+  for (; p < end; p += 128) {
+    _mm256_store_si256((__m256i*)(p), zero);
+    _mm256_store_si256((__m256i*)(p + 32), zero);
+    _mm256_store_si256((__m256i*)(p + 64), zero);
+    _mm256_store_si256((__m256i*)(p + 96), zero);
+  }
+  memset(p, 0, (char*)(dst) + n - p);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(void* dst, const void* src, size_t n) {
+  size_t head = align_head(dst, n, 32);
+  memcpy(dst, src, head);
+  char* d = (char*)(dst) + head;
+  const char* s = (const char*)(src) + head;
+  char* end = d + ((n - head) & ~(size_t)(127));
+  for (; d < end; d += 128, s += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(s));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(s + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(s + 64));
+    __m256i e = _mm256_loadu_si256((const __m256i*)(s + 96));
+    _mm256_stream_si256((__m256i*)(d), a);
+    _mm256_stream_si256((__m256i*)(d + 32), b);
+    _mm256_stream_si256((__m256i*)(d + 64), c);
+    _mm256_stream_si256((__m256i*)(d + 96), e);
+  }
+  _mm_sfence();
+  memcpy(d, s, (char*)(dst) + n - d);
+}
+
+__attribute__((target("avx512f")))
+static void zero_avx512(void* dst, size_t n) {
+  size_t head = align_head(dst, n, 64);
+  memset(dst, 0, head);
+  char* p = (char*)(dst) + head;
+  char* end = p + ((n - head) & ~(size_t)(255));
+  const __m512i zero = _mm512_setzero_si512();
+  for (; p < end; p += 256) {
+    _mm512_store_si512((void*)(p), zero);
+    _mm512_store_si512((void*)(p + 64), zero);
+    _mm512_store_si512((void*)(p + 128), zero);
+    _mm512_store_si512((void*)(p + 192), zero);
+  }
+  memset(p, 0, (char*)(dst) + n - p);
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(void* dst, const void* src, size_t n) {
+  size_t head = align_head(dst, n, 64);
+  memcpy(dst, src, head);
+  char* d = (char*)(dst) + head;
+  const char* s = (const char*)(src) + head;
+  char* end = d + ((n - head) & ~(size_t)(255));
+  for (; d < end; d += 256, s += 256) {
+    __m512i a = _mm512_loadu_si512((const void*)(s));
+    __m512i b = _mm512_loadu_si512((const void*)(s + 64));
+    __m512i c = _mm512_loadu_si512((const void*)(s + 128));
+    __m512i e = _mm512_loadu_si512((const void*)(s + 192));
+    _mm512_stream_si512((void*)(d), a);
+    _mm512_stream_si512((void*)(d + 64), b);
+    _mm512_stream_si512((void*)(d + 128), c);
+    _mm512_stream_si512((void*)(d + 192), e);
+  }
+  _mm_sfence();
+  memcpy(d, s, (char*)(dst) + n - d);
+}
+
+__attribute__((target("sse2")))
+static void fill_sse2(void* dst, uint32_t pattern, size_t n) {
+  size_t head = align_head(dst, n, 16);
+  fill_bytes(dst, pattern, 0, head);
+  uint32_t body = rotate_pattern(pattern, head);
+  char* p = (char*)(dst) + head;
+  char* end = p + ((n - head) & ~(size_t)(63));
+  const __m128i v = _mm_set1_epi32(body);
+  for (; p < end; p += 64) {
+    _mm_store_si128((__m128i*)(p), v);
+    _mm_store_si128((__m128i*)(p + 16), v);
+    _mm_store_si128((__m128i*)(p + 32), v);
+    _mm_store_si128((__m128i*)(p + 48), v);
+  }
+  end = (char*)(dst) + n;
+  size_t tail = (end - p) & ~(size_t)(3);
+  char* stop = p + tail;
+  for (; p < stop; p += 4) memcpy(p, &body, 4);
+  fill_bytes(p, body, 0, end - p);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(void* dst, uint32_t pattern, size_t n) {
+  size_t head = align_head(dst, n, 32);
+  fill_bytes(dst, pattern, 0, head);
+  uint32_t body = rotate_pattern(pattern, head);
+  char* p = (char*)(dst) + head;
+  char* end = p + ((n - head) & ~(size_t)(127));
+  const __m256i v = _mm256_set1_epi32(body);
+  for (; p < end; p += 128) {
+    _mm256_store_si256((__m256i*)(p), v);
+    _mm256_store_si256((__m256i*)(p + 32), v);
+    _mm256_store_si256((__m256i*)(p + 64), v);
+    _mm256_store_si256((__m256i*)(p + 96), v);
+  }
+  end = (char*)(dst) + n;
+  size_t tail = (end - p) & ~(size_t)(3);
+  char* stop = p + tail;
+  for (; p < stop; p += 4) memcpy(p, &body, 4);
+  fill_bytes(p, body, 0, end - p);
+}
+
+__attribute__((target("avx512f")))
+static void fill_avx512(void* dst, uint32_t pattern, size_t n) {
+  size_t head = align_head(dst, n, 64);
+  fill_bytes(dst, pattern, 0, head);
+  uint32_t body = rotate_pattern(pattern, head);
+  char* p = (char*)(dst) + head;
+  char* end = p + ((n - head) & ~(size_t)(255));
+  const __m512i v = _mm512_set1_epi32(body);
+  for (; p < end; p += 256) {
+    _mm512_store_si512((void*)(p), v);
+    _mm512_store_si512((void*)(p + 64), v);
+    _mm512_store_si512((void*)(p + 128), v);
+    _mm512_store_si512((void*)(p + 192), v);
+  }
+  end = (char*)(dst) + n;
+  size_t tail = (end - p) & ~(size_t)(3);
+  char* stop = p + tail;
+  for (; p < stop; p += 4) memcpy(p, &body, 4);
+  fill_bytes(p, body, 0, end - p);
+}
+
+__attribute__((target("sse2")))
+static void keyed_sse2(char* dst, const char* src, int count, int size,
+                       uint32_t key) {
+  if (size == 3) {
+    keyed_portable(dst, src, count, size, key);
     return;
   }
-  int offset = y * line_length + x;
-  *((color_t*)(img) + offset) = color;
+  const __m128i k = size == 2 ? _mm_set1_epi16(key) : _mm_set1_epi32(key);
+  const int per_vector = 16 / size;
+  int i;
+  // Blends the source over the destination where it differs from the key.
+  for (i = 0; i + per_vector <= count; i += per_vector) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i * size));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * size));
+    __m128i keyed = size == 2 ? _mm_cmpeq_epi16(s, k) : _mm_cmpeq_epi32(s, k);
+    __m128i out = _mm_or_si128(_mm_and_si128(keyed, d),
+                               _mm_andnot_si128(keyed, s));
+    _mm_storeu_si128((__m128i*)(dst + i * size), out);
+  }
+  keyed_portable(dst + i * size, src + i * size, count - i, size, key);
 }
 
-int cmp_to_zero(int n) {
-  if (n > 0) return 1;
-  if (n < 0) return -1;
-  return 0;
+/** Builds the shuffle that moves 4 pixels into 32-bit lanes as 0x00RRGGBB. */
+static void rgb_shuffle(const struct rgb_layout* layout, uint8_t* mask) {
+  int j;
+  for (j = 0; j < 4; ++j) {
+    mask[j * 4] = j * layout->step + layout->blue;
+    mask[j * 4 + 1] = j * layout->step + layout->green;
+    mask[j * 4 + 2] = j * layout->step + layout->red;
+    mask[j * 4 + 3] = 0x80;
+  }
 }
 
-void draw_line(void* img, int x1, int y1, int x2, int y2, color_t c) {
-  if (!initialized) return;
-  int x = x1;
-  int y = y1;
-  int w = x2 - x1;
-  int h = y2 - y1;
-  int dx1 = cmp_to_zero(w);
-  int dy1 = cmp_to_zero(h);
-  int dx2 = dx1;
-  int dy2 = 0;
-  int longest = w > 0 ? w : -w;
-  int shortest = h > 0 ? h : -h;
-  if (longest <= shortest) {
-    int tmp = longest;
-    longest = shortest;
-    shortest = tmp;
-    dy2 = dy1;
-    dx2 = 0;
-  }
-  int numerator = longest >> 1;
-  int i;
-  for (i = 0; i <= longest; ++i) {
-    draw_pixel(img, x, y, c);
-    numerator += shortest;
-    if (numerator >= longest) {
-      numerator -= longest;
-      x += dx1;
-      y += dy1;
+__attribute__((target("sse4.1")))
+static void convert_sse41(color_t* dst, const uint8_t* src, int count,
+                          const struct rgb_layout* layout,
+                          const uint8_t* dither) {
+  uint8_t bytes[16];
+  rgb_shuffle(layout, bytes);
+  const __m128i shuffle = _mm_loadu_si128((const __m128i*)(bytes));
+  const __m128i threshold = dither ?
+      _mm_loadu_si128((const __m128i*)(dither)) : _mm_setzero_si128();
+  const __m128i red = _mm_set1_epi32(0xF800);
+  const __m128i green = _mm_set1_epi32(0x07E0);
+  const __m128i blue = _mm_set1_epi32(0x001F);
+  const int step = layout->step;
+  int i;
+  // Every 16-byte load must stay within the row.
+  for (i = 0; i * step + 16 <= count * step; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i * step));
+    v = _mm_adds_epu8(_mm_shuffle_epi8(v, shuffle), threshold);
+    __m128i pixel = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 8), red),
+                     _mm_and_si128(_mm_srli_epi32(v, 5), green)),
+        _mm_and_si128(_mm_srli_epi32(v, 3), blue));
+    _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi32(pixel, pixel));
+  }
+  convert_portable(dst + i, src + i * step, count - i, layout, dither);
+}
+
+__attribute__((target("avx2")))
+static void convert_avx2(color_t* dst, const uint8_t* src, int count,
+                         const struct rgb_layout* layout,
+                         const uint8_t* dither) {
+  uint8_t bytes[16];
+  rgb_shuffle(layout, bytes);
+  const __m256i shuffle = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i*)(bytes)));
+  const __m256i threshold = dither ? _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i*)(dither))) : _mm256_setzero_si256();
+  const __m256i red = _mm256_set1_epi32(0xF800);
+  const __m256i green = _mm256_set1_epi32(0x07E0);
+  const __m256i blue = _mm256_set1_epi32(0x001F);
+  const int step = layout->step;
+  int i;
+  // Pixels 0-3 go to the low lane and 4-7 to the high one, since the byte
+  // shuffle cannot cross lanes.
+  for (i = 0; (i + 4) * step + 16 <= count * step; i += 8) {
+    __m256i v = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i*)(src + i * step))),
+        _mm_loadu_si128((const __m128i*)(src + (i + 4) * step)), 1);
+    v = _mm256_adds_epu8(_mm256_shuffle_epi8(v, shuffle), threshold);
+    __m256i pixel = _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(v, 8), red),
+                        _mm256_and_si256(_mm256_srli_epi32(v, 5), green)),
+        _mm256_and_si256(_mm256_srli_epi32(v, 3), blue));
+    __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(pixel, pixel), 0x08);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(packed));
+  }
+  convert_portable(dst + i, src + i * step, count - i, layout, dither);
+}
+
+/*
+ * The blend kernels unpack RGB565 into a 16-bit lane per channel, compute
+ * (src * a + dst * (256 - a) + 128) >> 8 the same way as blend_565(), which
+ * cannot overflow for 6-bit channels, and pack the result back.
+ */
+__attribute__((target("sse2")))
+static inline __m128i blend_lanes_sse2(__m128i d, __m128i s, __m128i a) {
+  const __m128i mask5 = _mm_set1_epi16(0x1F);
+  const __m128i mask6 = _mm_set1_epi16(0x3F);
+  const __m128i round = _mm_set1_epi16(128);
+  const __m128i inverse = _mm_sub_epi16(_mm_set1_epi16(256), a);
+  __m128i r = _mm_add_epi16(
+      _mm_add_epi16(_mm_mullo_epi16(_mm_srli_epi16(s, 11), a),
+                    _mm_mullo_epi16(_mm_srli_epi16(d, 11), inverse)), round);
+  __m128i g = _mm_add_epi16(
+      _mm_add_epi16(
+          _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(s, 5), mask6), a),
+          _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(d, 5), mask6),
+                          inverse)), round);
+  __m128i b = _mm_add_epi16(
+      _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(s, mask5), a),
+                    _mm_mullo_epi16(_mm_and_si128(d, mask5), inverse)), round);
+  return _mm_or_si128(
+      _mm_or_si128(_mm_slli_epi16(_mm_srli_epi16(r, 8), 11),
+                   _mm_slli_epi16(_mm_srli_epi16(g, 8), 5)),
+      _mm_srli_epi16(b, 8));
+}
+
+__attribute__((target("sse2")))
+static void blend_sse2(uint16_t* dst, const uint16_t* src,
+                       const uint8_t* alpha, int scale, int key, int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i scale_lanes = _mm_set1_epi16(scale);
+  const __m128i key_lanes = _mm_set1_epi16(key);
+  int i;
+  for (i = 0; i + 8 <= count; i += 8) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i a = scale_lanes;
+    if (alpha) {
+      a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(alpha + i)),
+                            zero);
+      a = _mm_add_epi16(a, _mm_srli_epi16(a, 7));
+      if (scale != 256) a = _mm_srli_epi16(_mm_mullo_epi16(a, scale_lanes), 8);
+    }
+    if (key != NO_COLOR_KEY) {
+      a = _mm_andnot_si128(_mm_cmpeq_epi16(s, key_lanes), a);
+    }
+    _mm_storeu_si128((__m128i*)(dst + i), blend_lanes_sse2(d, s, a));
+  }
+  blend_portable(dst + i, src + i, alpha ? alpha + i : NULL, scale, key,
+                 count - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend_lanes_avx2(__m256i d, __m256i s, __m256i a) {
+  const __m256i mask5 = _mm256_set1_epi16(0x1F);
+  const __m256i mask6 = _mm256_set1_epi16(0x3F);
+  const __m256i round = _mm256_set1_epi16(128);
+  const __m256i inverse = _mm256_sub_epi16(_mm256_set1_epi16(256), a);
+  __m256i r = _mm256_add_epi16(
+      _mm256_add_epi16(_mm256_mullo_epi16(_mm256_srli_epi16(s, 11), a),
+                       _mm256_mullo_epi16(_mm256_srli_epi16(d, 11), inverse)),
+      round);
+  __m256i g = _mm256_add_epi16(
+      _mm256_add_epi16(
+          _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(s, 5), mask6),
+                             a),
+          _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(d, 5), mask6),
+                             inverse)), round);
+  __m256i b = _mm256_add_epi16(
+      _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(s, mask5), a),
+                       _mm256_mullo_epi16(_mm256_and_si256(d, mask5),
+                                          inverse)), round);
+  return _mm256_or_si256(
+      _mm256_or_si256(_mm256_slli_epi16(_mm256_srli_epi16(r, 8), 11),
+                      _mm256_slli_epi16(_mm256_srli_epi16(g, 8), 5)),
+      _mm256_srli_epi16(b, 8));
+}
+
+__attribute__((target("avx2")))
+static void blend_avx2(uint16_t* dst, const uint16_t* src,
+                       const uint8_t* alpha, int scale, int key, int count) {
+  const __m256i scale_lanes = _mm256_set1_epi16(scale);
+  const __m256i key_lanes = _mm256_set1_epi16(key);
+  int i;
+  for (i = 0; i + 16 <= count; i += 16) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+    __m256i a = scale_lanes;
+    if (alpha) {
+      a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(alpha + i)));
+      a = _mm256_add_epi16(a, _mm256_srli_epi16(a, 7));
+      if (scale != 256) {
+        a = _mm256_srli_epi16(_mm256_mullo_epi16(a, scale_lanes), 8);
+      }
+    }
+    if (key != NO_COLOR_KEY) {
+      a = _mm256_andnot_si256(_mm256_cmpeq_epi16(s, key_lanes), a);
+    }
+    _mm256_storeu_si256((__m256i*)(dst + i), blend_lanes_avx2(d, s, a));
+  }
+  blend_portable(dst + i, src + i, alpha ? alpha + i : NULL, scale, key,
+                 count - i);
+}
+
+__attribute__((target("sse2")))
+static size_t mismatch_sse2(const char* a, const char* b, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    unsigned differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+    if (differ) return i + __builtin_ctz(differ);
+  }
+  return i + mismatch_portable(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const char* a, const char* b, size_t n) {
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m256i x0 = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i y0 = _mm256_loadu_si256((const __m256i*)(b + i));
+    __m256i x1 = _mm256_loadu_si256((const __m256i*)(a + i + 32));
+    __m256i y1 = _mm256_loadu_si256((const __m256i*)(b + i + 32));
+    __m256i same = _mm256_and_si256(_mm256_cmpeq_epi8(x0, y0),
+                                    _mm256_cmpeq_epi8(x1, y1));
+    if ((unsigned)(_mm256_movemask_epi8(same)) == 0xFFFFFFFFu) continue;
+    unsigned differ = ~(unsigned)(_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(x0, y0)));
+    if (differ) return i + __builtin_ctz(differ);
+    differ = ~(unsigned)(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, y1)));
+    return i + 32 + __builtin_ctz(differ);
+  }
+  return i + mismatch_sse2(a + i, b + i, n - i);
+}
+#endif  // HAVE_X86_SIMD
+
+/** Picks the widest memory kernels supported by the running CPU. */
+static void select_kernels() {
+  zero_kernel = zero_portable;
+  copy_kernel = copy_portable;
+  fill_kernel = fill_portable;
+  keyed_kernel = keyed_portable;
+  mismatch_kernel = mismatch_portable;
+  blend_kernel = blend_portable;
+  convert_kernel = convert_portable;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    zero_kernel = zero_avx512;
+    copy_kernel = copy_avx512;
+    fill_kernel = fill_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    zero_kernel = zero_avx2;
+    copy_kernel = copy_avx2;
+    fill_kernel = fill_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    zero_kernel = zero_sse2;
+    copy_kernel = copy_sse2;
+    fill_kernel = fill_sse2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    keyed_kernel = keyed_sse2;
+    mismatch_kernel = mismatch_sse2;
+    blend_kernel = blend_sse2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    mismatch_kernel = mismatch_avx2;
+    blend_kernel = blend_avx2;
+    convert_kernel = convert_avx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    convert_kernel = convert_sse41;
+  }
+#endif
+}
+
+/**
+ * Damaged area of a buffer, kept as an inclusive span of pixels per scanline.
+ * A scanline is clean when its min_x is greater than its max_x, and all
+ * scanlines outside of [top, bottom] are clean.
+ */
+struct damage {
+  int* min_x;
+  int* max_x;
+  int top;
+  int bottom;
+};
+
+/** Rectangle of pixels with inclusive bounds. */
+struct rect {
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+};
+
+/** Bookkeeping for a buffer handed out by new_offscreen_buffer(). */
+struct buffer {
+  void* mem;
+  size_t map_size;  // Size of the mapping of an offscreen buffer, else zero.
+  bool pooled;  // Freed and waiting to be handed out again.
+  bool tiled;  // Stored in tiles, see new_tiled_offscreen_buffer().
+  struct damage dirty;  // Pixels changed since the last blit of the buffer.
+  struct damage used;   // Pixels possibly non-zero since the last clear.
+};
+
+static struct buffer buffers[MAX_BUFFERS];
+static struct buffer* last_found;  // Cache for the most recent lookup.
+static void* last_blitted;  // The buffer currently shown on the screen.
+static void* capture_last;  // The buffer captured last.
+static int pooled_count;
+
+static void damage_reset(struct damage* d) {
+  int y;
+  for (y = d->top; y <= d->bottom; ++y) {
+    d->min_x[y] = line_length;
+    d->max_x[y] = -1;
+  }
+  d->top = line_count;
+  d->bottom = -1;
+}
+
+static void damage_add(struct damage* d, int y, int x0, int x1) {
+  if (y < d->top) d->top = y;
+  if (y > d->bottom) d->bottom = y;
+  if (x0 < d->min_x[y]) d->min_x[y] = x0;
+  if (x1 > d->max_x[y]) d->max_x[y] = x1;
+}
+
+static void damage_merge(struct damage* d, const struct damage* other) {
+  int y;
+  for (y = other->top; y <= other->bottom; ++y) {
+    if (other->min_x[y] <= other->max_x[y]) {
+      damage_add(d, y, other->min_x[y], other->max_x[y]);
+    }
+  }
+}
+
+/**
+ * Copies the damaged spans from src to dst, or zeroes them when src is NULL,
+ * and returns the number of bytes written. Consecutive full-width scanlines
+ * are coalesced into a single kernel call.
+ */
+static size_t damage_apply(const struct damage* d, char* dst,
+                           const char* src) {
+  size_t total = 0;
+  int y = d->top;
+  while (y <= d->bottom) {
+    if (d->min_x[y] > d->max_x[y]) {
+      ++y;
+      continue;
+    }
+    size_t offset = y * stride + d->min_x[y] * bytes_per_pixel;
+    size_t size = (d->max_x[y] - d->min_x[y] + 1) * bytes_per_pixel;
+    if (size == stride) {
+      while (y + 1 <= d->bottom && d->min_x[y + 1] == 0 &&
+             d->max_x[y + 1] == line_length - 1) {
+        size += stride;
+        ++y;
+      }
+    }
+    if (src) {
+      copy_kernel(dst + offset, src + offset, size);
     } else {
-      x += dx2;
-      y += dy2;
+      zero_kernel(dst + offset, size);
     }
+    total += size;
+    ++y;
   }
+  return total;
 }
 
-void* new_offscreen_buffer() {
-  if (!initialized) return NULL;
-  void* ob_mem = mmap(NULL, fb_size, PROT_READ | PROT_WRITE,
-                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (ob_mem == MAP_FAILED) return NULL;
-  return ob_mem;
+/** Copies one scanline of width pixels out of consecutive tiles. */
+static void detile_row(char* dst, const char* src, int width) {
+  const int side = 1 << TILED_SHIFT;
+  const size_t tile_bytes = (size_t)(bytes_per_pixel) << (2 * TILED_SHIFT);
+  // A tile row is a fixed-size copy, which compiles to a few vector moves.
+  for (; width >= side; width -= side, src += tile_bytes) {
+    switch (bytes_per_pixel) {
+      case 2:
+        memcpy(dst, src, 2 << TILED_SHIFT);
+        break;
+      case 3:
+        memcpy(dst, src, 3 << TILED_SHIFT);
+        break;
+      default:
+        memcpy(dst, src, 4 << TILED_SHIFT);
+    }
+    dst += bytes_per_pixel << TILED_SHIFT;
+  }
+  if (width > 0) memcpy(dst, src, width * bytes_per_pixel);
 }
 
-void blit(void *src) {
-  if (!initialized) return;
-  size_t i;
-  for (i = 0; i < fb_size; ++i) {
-    *((char*)(fb_mem) + i) = *((char*)(src) + i);
+/**
+ * The counterpart of damage_apply() for a tiled buffer. Copies the tiles
+ * holding damaged pixels from the tiled src to the linear dst, or zeroes them
+ * in the tiled dst when src is NULL, and returns the number of bytes written.
+ * A NULL damage covers every tile. Each row of tiles is handled as the range
+ * of tiles spanning the damage of its scanlines, which is contiguous.
+ */
+static size_t tiled_apply(const struct damage* d, char* dst,
+                          const char* src) {
+  const int side = 1 << TILED_SHIFT;
+  const size_t tile_bytes = (size_t)(bytes_per_pixel) << (2 * TILED_SHIFT);
+  size_t total = 0;
+  int top = d ? d->top : 0;
+  int bottom = d ? d->bottom : line_count - 1;
+  int band;
+  if (top > bottom) return 0;
+  for (band = top >> TILED_SHIFT; band <= bottom >> TILED_SHIFT; ++band) {
+    int y0 = band << TILED_SHIFT;
+    int y1 = y0 + side < line_count ? y0 + side : line_count;
+    int x0 = d ? line_length : 0;
+    int x1 = d ? -1 : line_length - 1;
+    int y;
+    for (y = y0; d && y < y1; ++y) {
+      if (d->min_x[y] < x0) x0 = d->min_x[y];
+      if (d->max_x[y] > x1) x1 = d->max_x[y];
+    }
+    if (x0 > x1) continue;
+    int first = x0 >> TILED_SHIFT;
+    int tiles = (x1 >> TILED_SHIFT) - first + 1;
+    size_t offset = ((size_t)(band) * tiles_per_row + first) * tile_bytes;
+    if (!src) {
+      zero_kernel(dst + offset, tiles * tile_bytes);
+      total += tiles * tile_bytes;
+      continue;
+    }
+    int start = first << TILED_SHIFT;
+    int end = (first + tiles) << TILED_SHIFT;
+    int width = (end < line_length ? end : line_length) - start;
+    for (y = y0; y < y1; ++y) {
+      detile_row(dst + y * stride + start * bytes_per_pixel,
+                 src + offset + (y - y0) * (bytes_per_pixel << TILED_SHIFT),
+                 width);
+    }
+    total += (size_t)(y1 - y0) * width * bytes_per_pixel;
+  }
+  return total;
+}
+
+static void damage_fill(struct damage* d) {
+  int y;
+  for (y = 0; y < line_count; ++y) damage_add(d, y, 0, line_length - 1);
+}
+
+static bool damage_init(struct damage* d) {
+  d->min_x = malloc(sizeof(int) * line_count * 2);
+  if (!d->min_x) return false;
+  d->max_x = d->min_x + line_count;
+  d->top = 0;
+  d->bottom = line_count - 1;
+  damage_reset(d);
+  return true;
+}
+
+/**
+ * Looks up the registry entry of a buffer. The present thread looks up
+ * buffers while the caller registers others, so entries are published with
+ * mem stored last.
+ */
+static struct buffer* find_buffer(void* img) {
+  int i;
+  struct buffer* hit = __atomic_load_n(&last_found, __ATOMIC_RELAXED);
+  if (hit && __atomic_load_n(&hit->mem, __ATOMIC_ACQUIRE) == img) return hit;
+  for (i = 0; i < MAX_BUFFERS; ++i) {
+    if (__atomic_load_n(&buffers[i].mem, __ATOMIC_ACQUIRE) == img) {
+      __atomic_store_n(&last_found, &buffers[i], __ATOMIC_RELAXED);
+      return &buffers[i];
+    }
+  }
+  return NULL;
+}
+
+/** Adds a buffer to the registry, returning NULL when it is not tracked. */
+static struct buffer* register_buffer(void* mem) {
+  int i;
+  for (i = 0; i < MAX_BUFFERS; ++i) {
+    if (buffers[i].mem) continue;
+    if (!damage_init(&buffers[i].dirty)) return NULL;
+    if (!damage_init(&buffers[i].used)) {
+      free(buffers[i].dirty.min_x);
+      return NULL;
+    }
+    buffers[i].map_size = 0;
+    buffers[i].pooled = false;
+    buffers[i].tiled = false;
+    __atomic_store_n(&buffers[i].mem, mem, __ATOMIC_RELEASE);
+    return &buffers[i];
+  }
+  return NULL;
+}
+
+static void unregister_buffer(struct buffer* buf) {
+  free(buf->dirty.min_x);
+  free(buf->used.min_x);
+  __atomic_store_n(&buf->mem, NULL, __ATOMIC_RELEASE);
+  __atomic_compare_exchange_n(&last_found, &buf, NULL, false,
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static bool is_tiled(const void* img) {
+  struct buffer* buf = find_buffer((void*)(img));
+  return buf && buf->tiled;
+}
+
+/** Records that the pixels [x0, x1] on scanline y of a buffer were drawn. */
+static void mark_drawn(struct buffer* buf, int y, int x0, int x1) {
+  if (!buf) return;
+  damage_add(&buf->dirty, y, x0, x1);
+  damage_add(&buf->used, y, x0, x1);
+}
+
+/**
+ * State of a Bresenham walk over the visible part of a line, starting at the
+ * pixel at byte address p with coordinates (x, y).
+ */
+struct walk {
+  char* p;
+  int x;
+  int y;
+  int sx;
+  int sy;
+  int count;
+  int numerator;
+  int longest;
+  int shortest;
+  uint32_t pixel;
+};
+
+/**
+ * The pixel loops for one framebuffer pixel format. They are stamped out by
+ * DEFINE_PIXEL_FORMAT once per pixel size, so the inner loops store pixels
+ * with a fixed-width write and never branch on the format.
+ */
+struct pixel_format {
+  int bits_per_pixel;
+  void (*put)(char* p, uint32_t pixel);
+  void (*fill_span)(char* p, uint32_t pixel, int count);
+  void (*walk_x_major)(struct buffer* buf, struct walk* w);
+  void (*walk_y_major)(struct buffer* buf, struct walk* w);
+  void (*walk_column)(struct buffer* buf, struct walk* w);
+  void (*walk_x_major_tiled)(struct buffer* buf, struct walk* w);
+  void (*walk_y_major_tiled)(struct buffer* buf, struct walk* w);
+  void (*put_points)(struct buffer* buf, void* img, const point_t* points,
+                     const int* order, int count);
+};
+
+static const struct pixel_format* format;
+static bool native_rgb565;  // Whether color_t values are already native.
+
+/** Scales a color channel value from one bit width to another. */
+static uint32_t scale_channel(uint32_t value, int from, int to) {
+  if (to <= from) return value >> (from - to);
+  uint32_t scaled = value << (to - from);
+  int filled = from;
+  // Repeat the high bits into the new low bits so that white stays white.
+  while (filled < to) {
+    scaled |= (scaled >> filled);
+    filled *= 2;
+  }
+  return scaled & ((1u << to) - 1);
+}
+
+/** Converts an RGB565 color to the pixel value of the framebuffer. */
+static uint32_t native_pixel(color_t c) {
+  if (native_rgb565) return c;
+  return scale_channel((c >> 11) & 0x1F, 5, var_info.red.length) <<
+             var_info.red.offset |
+         scale_channel((c >> 5) & 0x3F, 6, var_info.green.length) <<
+             var_info.green.offset |
+         scale_channel(c & 0x1F, 5, var_info.blue.length) <<
+             var_info.blue.offset;
+}
+
+/**
+ * Offset in pixels of (x, y) in a tiled buffer. Its tiles are stored in
+ * scanline order, and so are the pixels inside each tile.
+ */
+static inline size_t tiled_offset(int x, int y) {
+  const int mask = (1 << TILED_SHIFT) - 1;
+  size_t tile = (size_t)(y >> TILED_SHIFT) * tiles_per_row + (x >> TILED_SHIFT);
+  return tile << (2 * TILED_SHIFT) | (y & mask) << TILED_SHIFT | (x & mask);
+}
+
+#define STORE_16(p, v) (*(uint16_t*)(p) = (uint16_t)(v))
+// 24-bit pixels are not 2-byte aligned at odd x, so the low half goes
+// through memcpy, which x86 still turns into a single 16-bit store.
+#define STORE_24(p, v) \
+  (memcpy((p), &(uint16_t){(uint16_t)(v)}, 2), (p)[2] = (char)((v) >> 16))
+#define STORE_32(p, v) (*(uint32_t*)(p) = (v))
+
+#define DEFINE_PIXEL_FORMAT(bpp)                                              \
+  static void put_##bpp(char* p, uint32_t pixel) {                            \
+    STORE_##bpp(p, pixel);                                                    \
+  }                                                                           \
+                                                                              \
+  /* One run of pixels per scanline, recorded when the line moves on. */      \
+  static void walk_x_major_##bpp(struct buffer* buf, struct walk* w) {        \
+    char* p = w->p;                                                           \
+    int x = w->x;                                                             \
+    int y = w->y;                                                             \
+    int run_x = x;                                                            \
+    int numerator = w->numerator;                                             \
+    const int sx = w->sx;                                                     \
+    const int col_step = sx * (bpp / 8);                                      \
+    const int row_step = w->sy * stride;                                      \
+    const uint32_t pixel = w->pixel;                                          \
+    int n;                                                                    \
+    for (n = w->count; n > 0; --n) {                                          \
+      STORE_##bpp(p, pixel);                                                  \
+      p += col_step;                                                          \
+      numerator += w->shortest;                                               \
+      if (numerator >= w->longest) {                                          \
+        numerator -= w->longest;                                              \
+        p += row_step;                                                        \
+        mark_drawn(buf, y, sx > 0 ? run_x : x, sx > 0 ? x : run_x);           \
+        y += w->sy;                                                           \
+        run_x = x + sx;                                                       \
+      }                                                                       \
+      x += sx;                                                                \
+    }                                                                         \
+    x -= sx;                                                                  \
+    if (sx > 0 ? run_x <= x : run_x >= x) {                                   \
+      mark_drawn(buf, y, sx > 0 ? run_x : x, sx > 0 ? x : run_x);             \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  /* One pixel per scanline. */                                               \
+  static void walk_y_major_##bpp(struct buffer* buf, struct walk* w) {        \
+    char* p = w->p;                                                           \
+    int x = w->x;                                                             \
+    int y = w->y;                                                             \
+    int numerator = w->numerator;                                             \
+    const int col_step = w->sx * (bpp / 8);                                   \
+    const int row_step = w->sy * stride;                                      \
+    const uint32_t pixel = w->pixel;                                          \
+    int n;                                                                    \
+    for (n = w->count; n > 0; --n) {                                          \
+      STORE_##bpp(p, pixel);                                                  \
+      mark_drawn(buf, y, x, x);                                               \
+      p += row_step;                                                          \
+      y += w->sy;                                                             \
+      numerator += w->shortest;                                               \
+      if (numerator >= w->longest) {                                          \
+        numerator -= w->longest;                                              \
+        p += col_step;                                                        \
+        x += w->sx;                                                           \
+      }                                                                       \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  /* Vertical line. */                                                        \
+  static void walk_column_##bpp(struct buffer* buf, struct walk* w) {         \
+    char* p = w->p;                                                           \
+    const int row_step = w->sy * stride;                                      \
+    const uint32_t pixel = w->pixel;                                          \
+    int n;                                                                    \
+    int y;                                                                    \
+    for (n = w->count; n > 0; --n) {                                          \
+      STORE_##bpp(p, pixel);                                                  \
+      p += row_step;                                                          \
+    }                                                                         \
+    if (!buf) return;                                                         \
+    for (n = w->count, y = w->y; n > 0; --n, y += w->sy) {                    \
+      mark_drawn(buf, y, w->x, w->x);                                         \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  /* The walks above over a tiled buffer starting at w->p, which address */  \
+  /* every pixel through its tile. Columns are y-major walks. */             \
+  static void walk_x_major_tiled_##bpp(struct buffer* buf, struct walk* w) {  \
+    char* img = w->p;                                                         \
+    int x = w->x;                                                             \
+    int y = w->y;                                                             \
+    int run_x = x;                                                            \
+    int numerator = w->numerator;                                             \
+    const int sx = w->sx;                                                     \
+    const uint32_t pixel = w->pixel;                                          \
+    int n;                                                                    \
+    for (n = w->count; n > 0; --n) {                                          \
+      STORE_##bpp(img + tiled_offset(x, y) * (bpp / 8), pixel);               \
+      numerator += w->shortest;                                               \
+      if (numerator >= w->longest) {                                          \
+        numerator -= w->longest;                                              \
+        mark_drawn(buf, y, sx > 0 ? run_x : x, sx > 0 ? x : run_x);           \
+        y += w->sy;                                                           \
+        run_x = x + sx;                                                       \
+      }                                                                       \
+      x += sx;                                                                \
+    }                                                                         \
+    x -= sx;                                                                  \
+    if (sx > 0 ? run_x <= x : run_x >= x) {                                   \
+      mark_drawn(buf, y, sx > 0 ? run_x : x, sx > 0 ? x : run_x);             \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  static void walk_y_major_tiled_##bpp(struct buffer* buf, struct walk* w) {  \
+    char* img = w->p;                                                         \
+    int x = w->x;                                                             \
+    int y = w->y;                                                             \
+    int numerator = w->numerator;                                             \
+    const uint32_t pixel = w->pixel;                                          \
+    int n;                                                                    \
+    for (n = w->count; n > 0; --n) {                                          \
+      STORE_##bpp(img + tiled_offset(x, y) * (bpp / 8), pixel);               \
+      mark_drawn(buf, y, x, x);                                               \
+      y += w->sy;                                                             \
+      numerator += w->shortest;                                               \
+      if (numerator >= w->longest) {                                          \
+        numerator -= w->longest;                                              \
+        x += w->sx;                                                           \
+      }                                                                       \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  /* Draws the points in the given order, skipping those off the screen. */  \
+  static void put_points_##bpp(struct buffer* buf, void* img,                 \
+                               const point_t* points, const int* order,       \
+                               int count) {                                   \
+    int drawn = 0;                                                            \
+    int i;                                                                    \
+    for (i = 0; i < count; ++i) {                                             \
+      const point_t* pt = &points[order ? order[i] : i];                      \
+      if (pt->x < 0 || pt->y < 0 || pt->x >= line_length ||                   \
+          pt->y >= line_count) {                                              \
+        continue;                                                             \
+      }                                                                       \
+      char* p = buf && buf->tiled ?                                           \
+          (char*)(img) + tiled_offset(pt->x, pt->y) * (bpp / 8) :             \
+          (char*)(img) + pt->y * stride + pt->x * (bpp / 8);                  \
+      STORE_##bpp(p, native_pixel(pt->color));                                \
+      mark_drawn(buf, pt->y, pt->x, pt->x);                                   \
+      ++drawn;                                                                \
+    }                                                                         \
+    STATS_ADD(pixels, drawn);                                                 \
+  }
+
+DEFINE_PIXEL_FORMAT(16)
+DEFINE_PIXEL_FORMAT(24)
+DEFINE_PIXEL_FORMAT(32)
+
+static void fill_span_16(char* p, uint32_t pixel, int count) {
+  fill_kernel(p, pixel * 0x10001u, count * 2);
+}
+
+static void fill_span_24(char* p, uint32_t pixel, int count) {
+  for (; count > 0; --count, p += 3) STORE_24(p, pixel);
+}
+
+static void fill_span_32(char* p, uint32_t pixel, int count) {
+  fill_kernel(p, pixel, count * 4);
+}
+
+#define PIXEL_FORMAT(bpp)                                                     \
+  {bpp, put_##bpp, fill_span_##bpp, walk_x_major_##bpp, walk_y_major_##bpp,   \
+   walk_column_##bpp, walk_x_major_tiled_##bpp, walk_y_major_tiled_##bpp,     \
+   put_points_##bpp}
+
+static const struct pixel_format pixel_formats[] = {
+  PIXEL_FORMAT(16), PIXEL_FORMAT(24), PIXEL_FORMAT(32)
+};
+
+/** Returns the address of the pixel (x, y) of a linear or tiled buffer. */
+static char* pixel_address(const struct buffer* buf, void* img, int x, int y) {
+  if (buf && buf->tiled) {
+    return (char*)(img) + tiled_offset(x, y) * bytes_per_pixel;
+  }
+  return (char*)(img) + y * stride + x * bytes_per_pixel;
+}
+
+/**
+ * Fills count pixels of scanline y from x. In a tiled buffer the scanline is
+ * split at tile boundaries, since only the pixels within a tile row are
+ * contiguous.
+ */
+static void fill_row(const struct buffer* buf, void* img, int y, int x,
+                     int count, uint32_t pixel) {
+  if (!buf || !buf->tiled) {
+    format->fill_span(pixel_address(buf, img, x, y), pixel, count);
+    return;
+  }
+  const int side = 1 << TILED_SHIFT;
+  while (count > 0) {
+    int piece = side - (x & (side - 1));
+    if (piece > count) piece = count;
+    format->fill_span(pixel_address(buf, img, x, y), pixel, piece);
+    x += piece;
+    count -= piece;
+  }
+}
+
+/** Picks the pixel loops for the framebuffer, returning false if unknown. */
+static bool select_format(const struct fb_var_screeninfo* vsinfo) {
+  unsigned i;
+  format = NULL;
+  for (i = 0; i < sizeof(pixel_formats) / sizeof(pixel_formats[0]); ++i) {
+    if (pixel_formats[i].bits_per_pixel == vsinfo->bits_per_pixel) {
+      format = &pixel_formats[i];
+    }
+  }
+  if (!format) return false;
+  bytes_per_pixel = format->bits_per_pixel / 8;
+  native_rgb565 = vsinfo->bits_per_pixel == 16 &&
+      vsinfo->red.offset == 11 && vsinfo->red.length == 5 &&
+      vsinfo->green.offset == 5 && vsinfo->green.length == 6 &&
+      vsinfo->blue.offset == 0 && vsinfo->blue.length == 5;
+  // Some drivers leave the channel layout empty; assume RGB565 then.
+  if (vsinfo->bits_per_pixel == 16 && vsinfo->red.length == 0) {
+    native_rgb565 = true;
+  }
+  return true;
+}
+
+/** Reads the pixel at an index of a frame. */
+static inline uint32_t pixel_at(const char* frame, size_t i) {
+  uint32_t pixel = 0;
+  switch (bytes_per_pixel) {
+    case 2:
+      return *(const uint16_t*)(frame + i * 2);
+    case 4:
+      return *(const uint32_t*)(frame + i * 4);
+    default:
+      memcpy(&pixel, frame + i * bytes_per_pixel, bytes_per_pixel);
+      return pixel;
+  }
+}
+
+/**
+ * A display backend. It opens the screen as a file descriptor in fb that can
+ * be mapped, describes the geometry the way the fbdev ioctls do, and pans the
+ * display for page flipping. A backend whose display does not scan out the
+ * mapped memory sends the shown screen to it after every present.
+ */
+struct backend {
+  bool (*open)(const struct graphics_config* config,
+               struct fb_fix_screeninfo* fsinfo,
+               struct fb_var_screeninfo* vsinfo);
+  bool (*pan)(struct fb_var_screeninfo* vsinfo);
+  void (*wait_vsync)();
+  void (*show)(const char* screen);  // NULL when the memory is scanned out.
+  void (*close)();  // Restores the display at exit, may be NULL.
+  bool uses_terminal;  // Whether the terminal is switched to raw input.
+};
+
+static const struct backend* backend;
+
+static bool fbdev_open(const struct graphics_config* config,
+                       struct fb_fix_screeninfo* fsinfo,
+                       struct fb_var_screeninfo* vsinfo) {
+  fb = open(config->path ? config->path : "/dev/fb0", O_RDWR);
+  if (fb == -1) return false;
+  if (ioctl(fb, FBIOGET_FSCREENINFO, fsinfo) == -1) return false;
+  if (ioctl(fb, FBIOGET_VSCREENINFO, vsinfo) == -1) return false;
+  return true;
+}
+
+static bool fbdev_pan(struct fb_var_screeninfo* vsinfo) {
+  return ioctl(fb, FBIOPAN_DISPLAY, vsinfo) != -1;
+}
+
+static void fbdev_wait_vsync() {
+  __u32 crtc = 0;
+  ioctl(fb, FBIO_WAITFORVSYNC, &crtc);
+}
+
+static const struct backend fbdev_backend = {
+  fbdev_open, fbdev_pan, fbdev_wait_vsync, NULL, NULL, true
+};
+
+/**
+ * The headless backend maps a regular file, or an anonymous memory file when
+ * no path is given, as the screen. The geometry comes from the configuration
+ * and is laid out like an fbdev device without line padding.
+ */
+static bool file_open(const struct graphics_config* config,
+                      struct fb_fix_screeninfo* fsinfo,
+                      struct fb_var_screeninfo* vsinfo) {
+  int bpp = config->bits_per_pixel ? config->bits_per_pixel : 16;
+  int virtual_height = config->virtual_height > config->height ?
+      config->virtual_height : config->height;
+  if (config->width <= 0 || config->height <= 0) return false;
+  if (bpp != 16 && bpp != 24 && bpp != 32) return false;
+  if (config->path) {
+    fb = open(config->path, O_RDWR | O_CREAT, 0644);
+  } else {
+#ifdef MFD_CLOEXEC
+    fb = memfd_create("graphics", MFD_CLOEXEC);
+#else
+    char path[] = "/tmp/graphicsXXXXXX";
+    fb = mkstemp(path);
+    if (fb != -1) unlink(path);
+#endif
+  }
+  if (fb == -1) return false;
+  memset(fsinfo, 0, sizeof(*fsinfo));
+  memset(vsinfo, 0, sizeof(*vsinfo));
+  fsinfo->line_length = config->width * bpp / 8;
+  fsinfo->ypanstep = 1;
+  vsinfo->xres = vsinfo->xres_virtual = config->width;
+  vsinfo->yres = config->height;
+  vsinfo->yres_virtual = virtual_height;
+  vsinfo->bits_per_pixel = bpp;
+  if (bpp == 16) {
+    vsinfo->red.offset = 11;
+    vsinfo->red.length = vsinfo->blue.length = 5;
+    vsinfo->green.offset = 5;
+    vsinfo->green.length = 6;
+  } else {
+    vsinfo->red.offset = 16;
+    vsinfo->green.offset = 8;
+    vsinfo->red.length = vsinfo->green.length = vsinfo->blue.length = 8;
+  }
+  return ftruncate(fb, (off_t)(fsinfo->line_length) * virtual_height) != -1;
+}
+
+static bool file_pan(struct fb_var_screeninfo* vsinfo) {
+  return true;
+}
+
+static void file_wait_vsync() {
+}
+
+static const struct backend file_backend = {
+  file_open, file_pan, file_wait_vsync, NULL, NULL, false
+};
+
+/*
+ * The terminal backend keeps the screen in memory like the headless backend
+ * and draws it on standard output with truecolor escape sequences, one
+ * character cell for every two pixels stacked vertically. It keeps the last
+ * frame it sent and only sends the cells that changed since then, moving the
+ * cursor over the unchanged ones and setting a color only when it differs
+ * from the current one, so that a frame costs little over a slow link.
+ */
+#define TERM_MAX_CELL_BYTES 64  // A cursor move, both colors and a glyph.
+#define TERM_UPPER_HALF "\342\226\200"  // U+2580, foreground on top.
+#define TERM_LOWER_HALF "\342\226\204"  // U+2584, foreground below.
+#define TERM_FULL_BLOCK "\342\226\210"  // U+2588.
+
+static char* term_prev;  // The frame last sent, valid after the first.
+static bool term_prev_valid;
+static int term_rows;
+static int term_cols;
+static char* term_out;  // Escape sequences of the frame being sent.
+static size_t term_size;
+// The cursor position and colors of the terminal, or -1 when unknown.
+static int term_row;
+static int term_col;
+static long long term_fg;
+static long long term_bg;
+
+static void term_puts(const char* s) {
+  size_t length = strlen(s);
+  memcpy(term_out + term_size, s, length);
+  term_size += length;
+}
+
+static void term_number(unsigned value) {
+  char digits[10];
+  int count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (count > 0) term_out[term_size++] = digits[--count];
+}
+
+/** Appends the channels of a native pixel as "r;g;b" with 8 bits each. */
+static void term_rgb(uint32_t pixel) {
+  const struct fb_bitfield* channels[3] = {
+    &var_info.red, &var_info.green, &var_info.blue
+  };
+  int i;
+  for (i = 0; i < 3; ++i) {
+    unsigned max = (1u << channels[i]->length) - 1;
+    unsigned value = (pixel >> channels[i]->offset) & max;
+    if (i > 0) term_out[term_size++] = ';';
+    term_number(max ? value * 255 / max : 0);
+  }
+}
+
+/** Sets the foreground and background colors that differ. */
+static void term_colors(long long fg, long long bg) {
+  if (fg == term_fg && bg == term_bg) return;
+  term_puts("\033[");
+  if (fg != term_fg) {
+    term_puts("38;2;");
+    term_rgb(fg);
+    if (bg != term_bg) term_out[term_size++] = ';';
+  }
+  if (bg != term_bg) {
+    term_puts("48;2;");
+    term_rgb(bg);
+  }
+  term_out[term_size++] = 'm';
+  term_fg = fg;
+  term_bg = bg;
+}
+
+/** Moves the cursor to a cell, forward on the same row when it can. */
+static void term_move(int row, int col) {
+  if (row == term_row && col == term_col) return;
+  term_puts("\033[");
+  if (row == term_row && col > term_col) {
+    term_number(col - term_col);
+    term_out[term_size++] = 'C';
+  } else {
+    term_number(row + 1);
+    term_out[term_size++] = ';';
+    term_number(col + 1);
+    term_out[term_size++] = 'H';
+  }
+  term_row = row;
+  term_col = col;
+}
+
+/**
+ * Draws a cell with the cursor on it, picking the glyph that needs the fewest
+ * color changes.
+ */
+static void term_cell(uint32_t top, uint32_t bottom) {
+  if (top == bottom) {
+    if (top == term_fg) {
+      term_puts(TERM_FULL_BLOCK);
+    } else {
+      term_colors(term_fg, top);
+      term_out[term_size++] = ' ';
+    }
+  } else {
+    int upper = (top != term_fg) + (bottom != term_bg);
+    int lower = (bottom != term_fg) + (top != term_bg);
+    if (lower < upper) {
+      term_colors(bottom, top);
+      term_puts(TERM_LOWER_HALF);
+    } else {
+      term_colors(top, bottom);
+      term_puts(TERM_UPPER_HALF);
+    }
+  }
+  // Past the last column the terminal may wrap, so forget the position.
+  if (++term_col == term_cols) term_row = term_col = -1;
+}
+
+static void term_flush() {
+  size_t done = 0;
+  while (done < term_size) {
+    ssize_t count = write(STDOUT_FILENO, term_out + done, term_size - done);
+    if (count == -1 && errno == EINTR) continue;
+    if (count <= 0) break;
+    done += count;
+  }
+  term_size = 0;
+}
+
+static bool terminal_open(const struct graphics_config* config,
+                          struct fb_fix_screeninfo* fsinfo,
+                          struct fb_var_screeninfo* vsinfo) {
+  struct graphics_config file_config = *config;
+  struct winsize size;
+  file_config.path = NULL;
+  if (config->width <= 0 || config->height <= 0) {
+    // Fill the window but its last line, which is left for the shell.
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1 || size.ws_row < 2 ||
+        size.ws_col == 0) {
+      size.ws_row = 25;
+      size.ws_col = 80;
+    }
+    file_config.width = size.ws_col;
+    file_config.height = (size.ws_row - 1) * 2;
+  }
+  if (!file_open(&file_config, fsinfo, vsinfo)) return false;
+  term_cols = vsinfo->xres;
+  term_rows = (vsinfo->yres + 1) / 2;
+  term_prev = malloc((size_t)(fsinfo->line_length) * vsinfo->yres);
+  term_out = malloc((size_t)(term_rows) * term_cols * TERM_MAX_CELL_BYTES +
+                    TERM_MAX_CELL_BYTES);
+  if (!term_prev || !term_out) return false;
+  term_prev_valid = false;
+  term_row = term_col = -1;
+  term_fg = term_bg = -1;
+  term_size = 0;
+  term_puts("\033[?25l");  // Hides the cursor.
+  term_flush();
+  return true;
+}
+
+static void terminal_show(const char* screen) {
+  const int size = bytes_per_pixel;
+  int row;
+  for (row = 0; row < term_rows; ++row) {
+    const size_t offset = (size_t)(2 * row) * stride;
+    const char* top = screen + offset;
+    const char* prev_top = term_prev + offset;
+    // An odd last line is shown over black.
+    const bool has_bottom = 2 * row + 1 < (int)(var_info.yres);
+    int col = 0;
+    bool changed = false;
+    while (col < term_cols) {
+      if (term_prev_valid) {
+        size_t bytes = (term_cols - col) * size;
+        size_t same = mismatch_kernel(prev_top + col * size, top + col * size,
+                                      bytes);
+        if (has_bottom) {
+          size_t below = mismatch_kernel(prev_top + stride + col * size,
+                                         top + stride + col * size, same);
+          if (below < same) same = below;
+        }
+        col += same / size;
+        if (col >= term_cols) break;
+      }
+      term_move(row, col);
+      term_cell(pixel_at(top, col),
+                has_bottom ? pixel_at(top + stride, col) : 0);
+      changed = true;
+      ++col;
+    }
+    if (changed) {
+      memcpy(term_prev + offset, top, has_bottom ? 2 * stride : stride);
+    }
+  }
+  term_prev_valid = true;
+  size_t sent = term_size;
+  term_flush();
+  STATS_ADD(terminal_bytes, sent);
+}
+
+static void terminal_close() {
+  term_puts("\033[0m\033[?25h\033[");  // Resets the colors, shows the cursor.
+  term_number(term_rows + 1);
+  term_puts(";1H");
+  term_flush();
+  free(term_prev);
+  free(term_out);
+  term_prev = term_out = NULL;
+}
+
+static const struct backend terminal_backend = {
+  terminal_open, file_pan, file_wait_vsync, terminal_show, terminal_close,
+  true
+};
+
+/**
+ * Splits the virtual framebuffer into pages of the visible height when the
+ * device can pan vertically. Otherwise page_count stays zero and presentation
+ * falls back to copying.
+ */
+static void setup_pages(const struct fb_fix_screeninfo* fsinfo) {
+  int i;
+  page_count = 0;
+  if (fsinfo->ypanstep == 0 || var_info.yres == 0) return;
+  if (var_info.yoffset % var_info.yres != 0) return;
+  int count = var_info.yres_virtual / var_info.yres;
+  if (count < 2) return;
+  if (count > MAX_PAGES) count = MAX_PAGES;
+  for (i = 0; i < count; ++i) {
+    pages[i] = (char*)(fb_mem) + i * fb_size;
+    struct buffer* buf = register_buffer(pages[i]);
+    if (!buf) return;
+    // The content of video memory is unknown, so treat all of it as drawn.
+    damage_fill(&buf->used);
+  }
+  shown_page = var_info.yoffset / var_info.yres;
+  if (shown_page >= count) return;
+  page_count = count;
+}
+
+/** Pans the display to the given page, returning false on failure. */
+static bool pan_to_page(int page) {
+  var_info.xoffset = 0;
+  var_info.yoffset = page * var_info.yres;
+  if (vsync_enabled) backend->wait_vsync();
+  if (!backend->pan(&var_info)) return false;
+  shown_page = page;
+  screen_mem = pages[page];
+  return true;
+}
+
+/**
+ * Reads the configuration from the environment:
+ *   GRAPHICS_BACKEND         "fbdev" (default), "file" or "terminal"
+ *   GRAPHICS_PATH            framebuffer device or backing file
+ *   GRAPHICS_GEOMETRY        screen size of the file or terminal backend,
+ *                            e.g. "640x480"; the terminal window by default
+ *   GRAPHICS_VIRTUAL_HEIGHT  height of the file backend including pages
+ *   GRAPHICS_BPP             bits per pixel of the file backend
+ *   GRAPHICS_THREADS         number of rasterizer threads
+ *   GRAPHICS_STATS           1 to collect stats, 2 to also print them at exit
+ *   GRAPHICS_MAX_QUEUED      frames present_frame() may queue, 1 or 2
+ *   GRAPHICS_CAPTURE         file to capture the presented frames to
+ */
+static void read_env_config(struct graphics_config* config) {
+  const char* value;
+  memset(config, 0, sizeof(*config));
+  config->backend = GRAPHICS_BACKEND_FBDEV;
+  if ((value = getenv("GRAPHICS_BACKEND"))) {
+    if (strcmp(value, "file") == 0) config->backend = GRAPHICS_BACKEND_FILE;
+    if (strcmp(value, "terminal") == 0) {
+      config->backend = GRAPHICS_BACKEND_TERMINAL;
+    }
+  }
+  config->path = getenv("GRAPHICS_PATH");
+  if ((value = getenv("GRAPHICS_GEOMETRY"))) {
+    char* end;
+    config->width = strtol(value, &end, 10);
+    if (*end == 'x') config->height = strtol(end + 1, NULL, 10);
+  }
+  if ((value = getenv("GRAPHICS_VIRTUAL_HEIGHT"))) {
+    config->virtual_height = atoi(value);
+  }
+  if ((value = getenv("GRAPHICS_BPP"))) config->bits_per_pixel = atoi(value);
+  if ((value = getenv("GRAPHICS_THREADS"))) config->threads = atoi(value);
+  if ((value = getenv("GRAPHICS_STATS"))) config->stats = atoi(value);
+  config->capture_path = getenv("GRAPHICS_CAPTURE");
+  if ((value = getenv("GRAPHICS_MAX_QUEUED"))) {
+    config->max_queued_frames = atoi(value);
+  }
+}
+
+void init_graphics() {
+  struct graphics_config config;
+  read_env_config(&config);
+  init_graphics_with(&config);
+}
+
+void init_graphics_with(const struct graphics_config* config) {
+  struct fb_fix_screeninfo fsinfo;
+  struct termios tios;
+
+  if (initialized) return;
+  select_kernels();
+  switch (config->backend) {
+    case GRAPHICS_BACKEND_FILE:
+      backend = &file_backend;
+      break;
+    case GRAPHICS_BACKEND_TERMINAL:
+      backend = &terminal_backend;
+      break;
+    default:
+      backend = &fbdev_backend;
+  }
+  if (!backend->open(config, &fsinfo, &var_info)) return;
+  if (!select_format(&var_info)) return;
+  line_count = var_info.yres;
+  line_length = fsinfo.line_length / bytes_per_pixel;
+  stride = fsinfo.line_length;
+  fb_size = line_count * stride;
+  tiles_per_row = (line_length + (1 << TILED_SHIFT) - 1) >> TILED_SHIFT;
+  tiled_size = (size_t)(tiles_per_row) *
+      ((line_count + (1 << TILED_SHIFT) - 1) >> TILED_SHIFT) *
+      (bytes_per_pixel << (2 * TILED_SHIFT));
+  fb_map_size = var_info.yres_virtual * stride;
+  fb_mem = mmap(NULL, fb_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fb, 0);
+  if (fb_mem == MAP_FAILED) return;
+  initial_yoffset = var_info.yoffset;
+  screen_mem = (char*)(fb_mem) + initial_yoffset * stride;
+  setup_pages(&fsinfo);
+  if (backend->uses_terminal) {
+    write(STDOUT_FILENO, CLEAR_SCREEN_SEQ, 4);
+    if (ioctl(STDIN_FILENO, TCGETS, &tios) == -1) return;
+    tios.c_lflag &= ~(ICANON | ECHO);
+    if (ioctl(STDIN_FILENO, TCSETS, &tios) == -1) return;
+  }
+  initialized = true;
+  stats_mode = config->stats;
+  reset_graphics_stats();
+  start_workers(config->threads);
+  set_max_queued_frames(config->max_queued_frames);
+  if (config->capture_path) start_capture(config->capture_path);
+}
+
+void exit_graphics() {
+  struct termios tios;
+  int i;
+
+  if (!initialized) return;
+  stop_workers();
+  stop_present_thread();
+  stop_capture();
+  if (stats_mode == 2) dump_stats();
+  for (i = 0; i < MAX_BUFFERS; ++i) {
+    if (!buffers[i].mem) continue;
+    if (buffers[i].map_size) munmap(buffers[i].mem, buffers[i].map_size);
+    unregister_buffer(&buffers[i]);
+  }
+  drop_layers();
+  pooled_count = 0;
+  last_blitted = NULL;
+  fallback_back_buffer = NULL;
+  if (page_count > 0 && var_info.yoffset != initial_yoffset) {
+    var_info.yoffset = initial_yoffset;
+    backend->pan(&var_info);
+  }
+  page_count = 0;
+  if (backend->close) backend->close();
+  if (munmap(fb_mem, fb_map_size) == -1) return;
+  if (close(fb) == -1) return;
+  initialized = false;
+  if (!backend->uses_terminal) return;
+  if (ioctl(STDIN_FILENO, TCGETS, &tios) == -1) return;
+  tios.c_lflag |= (ICANON | ECHO);
+  if (ioctl(STDIN_FILENO, TCSETS, &tios) == -1) return;
+}
+
+// Queue of key events read from standard input but not yet consumed.
+static key_event_t events[MAX_EVENTS];
+static unsigned event_head;
+static unsigned event_tail;
+
+long long graphics_clock_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Waits until standard input is readable or the deadline passes, returning
+ * whether input is available. A negative deadline waits forever.
+ */
+static bool wait_input(long long deadline_ns) {
+  while (true) {
+    fd_set fds;
+    struct timeval timeout;
+    struct timeval* timeout_ptr = NULL;
+    FD_ZERO(&fds);
+    FD_SET(STDIN_FILENO, &fds);
+    if (deadline_ns >= 0) {
+      long long remaining = deadline_ns - graphics_clock_ns();
+      if (remaining < 0) remaining = 0;
+      timeout.tv_sec = remaining / 1000000000LL;
+      timeout.tv_usec = (remaining % 1000000000LL) / 1000;
+      timeout_ptr = &timeout;
+    }
+    int ready = select(STDIN_FILENO + 1, &fds, NULL, NULL, timeout_ptr);
+    if (ready > 0) return true;
+    if (ready == 0 || errno != EINTR) return false;
+  }
+}
+
+/**
+ * Moves the keys waiting on standard input into the event queue without
+ * blocking. Returns the number of keys read, or -1 at end of input.
+ */
+static int read_keys() {
+  char keys[MAX_EVENTS];
+  int space = MAX_EVENTS - (event_tail - event_head);
+  int i;
+  if (space == 0 || !wait_input(0)) return 0;
+  int count = read(STDIN_FILENO, keys, space);
+  if (count <= 0) return -1;
+  long long now = graphics_clock_ns();
+  for (i = 0; i < count; ++i, ++event_tail) {
+    events[event_tail % MAX_EVENTS].key = keys[i];
+    events[event_tail % MAX_EVENTS].timestamp_ns = now;
+  }
+  return count;
+}
+
+int poll_events(key_event_t* out, int max, long long deadline_ns) {
+  int count = 0;
+  read_keys();
+  while (event_head == event_tail) {
+    if (!wait_input(deadline_ns) || read_keys() < 0) return 0;
+  }
+  while (count < max && event_head != event_tail) {
+    out[count++] = events[event_head++ % MAX_EVENTS];
+  }
+  return count;
+}
+
+char getkey() {
+  key_event_t event;
+  if (poll_events(&event, 1, -1) > 0) return event.key;
+  return 0;
+}
+
+void start_frame_scheduler(frame_scheduler_t* scheduler, int fps) {
+  scheduler->period_ns = 1000000000LL / (fps > 0 ? fps : 1);
+  scheduler->deadline_ns = graphics_clock_ns() + scheduler->period_ns;
+  scheduler->missed = 0;
+}
+
+int wait_next_frame(frame_scheduler_t* scheduler) {
+  struct timespec deadline = {
+    scheduler->deadline_ns / 1000000000LL,
+    scheduler->deadline_ns % 1000000000LL
+  };
+  // Sleeping until an absolute time keeps the frame rate from drifting.
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+         EINTR) {
+  }
+  int missed = 0;
+  long long now = graphics_clock_ns();
+  scheduler->deadline_ns += scheduler->period_ns;
+  if (now >= scheduler->deadline_ns) {
+    // Skip the frames that are already late instead of bursting to catch up.
+    missed = (now - scheduler->deadline_ns) / scheduler->period_ns + 1;
+    scheduler->deadline_ns += missed * scheduler->period_ns;
+    scheduler->missed += missed;
+  }
+  return missed;
+}
+
+void sleep_ms(long ms) {
+  struct timespec sleep_time = {ms / 1000, (ms % 1000) * 1000000};
+  nanosleep(&sleep_time, NULL);
+}
+
+void clear_screen(void* img) {
+  if (!initialized) return;
+  render_sync();
+  long long start = stats_start();
+  struct buffer* buf = find_buffer(img);
+  if (!buf) {
+    zero_kernel(img, fb_size);
+  } else {
+    // Only the pixels drawn since the last clear can be non-zero.
+    if (buf->tiled) {
+      tiled_apply(&buf->used, img, NULL);
+    } else {
+      damage_apply(&buf->used, img, NULL);
+    }
+    damage_merge(&buf->dirty, &buf->used);
+    damage_reset(&buf->used);
+  }
+  STATS_ADD(clears, 1);
+  STATS_TIME(clear_ns, start);
+}
+
+void draw_pixel(void* img, int x, int y, color_t color) {
+  if (!initialized) return;
+  render_sync();
+  STATS_ADD(primitives, 1);
+  if (x < 0 || y < 0 || x >= line_length || y >= line_count) {
+    // Illegal location.
+    return;
+  }
+  struct buffer* buf = find_buffer(img);
+  format->put(pixel_address(buf, img, x, y), native_pixel(color));
+  mark_drawn(buf, y, x, x);
+  STATS_ADD(pixels, 1);
+}
+
+int cmp_to_zero(int n) {
+  if (n > 0) return 1;
+  if (n < 0) return -1;
+  return 0;
+}
+
+static long long floor_div(long long a, long long b) {
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static long long ceil_div(long long a, long long b) {
+  return a >= 0 ? (a + b - 1) / b : -(-a / b);
+}
+
+/** How a clipped line is drawn, see clip_line(). */
+enum line_kind {
+  LINE_NONE,  // Entirely outside the clip rectangle.
+  LINE_POINT,
+  LINE_SPAN,  // Horizontal, from x to the right.
+  LINE_X_MAJOR,
+  LINE_COLUMN,  // Vertical.
+  LINE_Y_MAJOR
+};
+
+/**
+ * Clips the Bresenham line from (x1, y1) to (x2, y2) to the clip rectangle,
+ * describing the visible part in walk, all but its pointer. The line is
+ * clipped once up front by solving for the first and last step inside the
+ * rectangle, and the error term at the first visible step is computed
+ * exactly, so the pixels drawn are the same as when every step is checked
+ * against the bounds.
+ */
+static enum line_kind clip_line(const struct rect* clip, int x1, int y1,
+                                int x2, int y2, uint32_t pixel,
+                                struct walk* walk) {
+  int w = x2 - x1;
+  int h = y2 - y1;
+  int sx = cmp_to_zero(w);
+  int sy = cmp_to_zero(h);
+  int adx = w > 0 ? w : -w;
+  int ady = h > 0 ? h : -h;
+  bool x_major = adx > ady;
+  // Step i moves one pixel along the major axis, and the minor coordinate is
+  // offset by k(i) = floor((longest / 2 + i * shortest) / longest) pixels.
+  long long longest = x_major ? adx : ady;
+  long long shortest = x_major ? ady : adx;
+  long long bias = longest >> 1;
+  if (longest == 0) {
+    if (x1 < clip->x0 || x1 > clip->x1 || y1 < clip->y0 || y1 > clip->y1) {
+      return LINE_NONE;
+    }
+    *walk = (struct walk){NULL, x1, y1, 0, 0, 1, 0, 0, 0, pixel};
+    return LINE_POINT;
+  }
+  int major_start = x_major ? x1 : y1;
+  int minor_start = x_major ? y1 : x1;
+  int major_sign = x_major ? sx : sy;
+  int minor_sign = x_major ? sy : sx;
+  int major_lo = x_major ? clip->x0 : clip->y0;
+  int major_hi = x_major ? clip->x1 : clip->y1;
+  int minor_lo = x_major ? clip->y0 : clip->x0;
+  int minor_hi = x_major ? clip->y1 : clip->x1;
+  // Steps that keep the major coordinate inside the clip rectangle.
+  long long first = major_sign > 0 ? major_lo - major_start
+                                   : major_start - major_hi;
+  long long last = major_sign > 0 ? major_hi - major_start
+                                  : major_start - major_lo;
+  if (first < 0) first = 0;
+  if (last > longest) last = longest;
+  // Steps that keep the minor coordinate inside, through the bounds on k(i).
+  if (shortest == 0) {
+    if (minor_start < minor_lo || minor_start > minor_hi) return LINE_NONE;
+  } else {
+    long long k_lo = minor_sign > 0 ? minor_lo - minor_start
+                                    : minor_start - minor_hi;
+    long long k_hi = minor_sign > 0 ? minor_hi - minor_start
+                                    : minor_start - minor_lo;
+    long long i_lo = ceil_div(k_lo * longest - bias, shortest);
+    long long i_hi = floor_div(k_hi * longest + longest - 1 - bias, shortest);
+    if (i_lo > first) first = i_lo;
+    if (i_hi < last) last = i_hi;
+  }
+  if (first > last) return LINE_NONE;
+
+  long long carries = floor_div(bias + first * shortest, longest);
+  int numerator = bias + first * shortest - carries * longest;
+  int x = x1 + sx * (x_major ? first : carries);
+  int y = y1 + sy * (x_major ? carries : first);
+  int count = last - first + 1;
+  *walk = (struct walk){
+    NULL, x, y, sx, sy, count, numerator, longest, shortest, pixel
+  };
+  if (shortest == 0 && x_major) {
+    walk->x = sx > 0 ? x : x - count + 1;
+    walk->sx = 1;
+    return LINE_SPAN;
+  }
+  if (x_major) return LINE_X_MAJOR;
+  return shortest == 0 ? LINE_COLUMN : LINE_Y_MAJOR;
+}
+
+/** Draws a line clipped by clip_line() with the pixel loops of the format. */
+static void draw_walk(struct buffer* buf, void* img, enum line_kind kind,
+                      struct walk* walk) {
+  const bool tiled = buf && buf->tiled;
+  // clip_line() leaves the walk unset for a line outside the screen.
+  if (kind == LINE_NONE) return;
+  // The tiled walks address pixels from the start of the buffer.
+  walk->p = tiled ? img : pixel_address(buf, img, walk->x, walk->y);
+  switch (kind) {
+    case LINE_NONE:
+      break;
+    case LINE_POINT:
+      format->put(pixel_address(buf, img, walk->x, walk->y), walk->pixel);
+      mark_drawn(buf, walk->y, walk->x, walk->x);
+      break;
+    case LINE_SPAN:
+      fill_row(buf, img, walk->y, walk->x, walk->count, walk->pixel);
+      mark_drawn(buf, walk->y, walk->x, walk->x + walk->count - 1);
+      break;
+    case LINE_X_MAJOR:
+      if (tiled) {
+        format->walk_x_major_tiled(buf, walk);
+      } else {
+        format->walk_x_major(buf, walk);
+      }
+      break;
+    case LINE_COLUMN:
+      if (tiled) {
+        format->walk_y_major_tiled(buf, walk);
+      } else {
+        format->walk_column(buf, walk);
+      }
+      break;
+    case LINE_Y_MAJOR:
+      if (tiled) {
+        format->walk_y_major_tiled(buf, walk);
+      } else {
+        format->walk_y_major(buf, walk);
+      }
+      break;
+  }
+  STATS_ADD(pixels, walk->count);
+}
+
+/** Rasterizes the part of a line that lies inside the clip rectangle. */
+static void raster_line(struct buffer* buf, void* img, const struct rect* clip,
+                        int x1, int y1, int x2, int y2, color_t c) {
+  struct walk walk;
+  enum line_kind kind = clip_line(clip, x1, y1, x2, y2, native_pixel(c), &walk);
+  draw_walk(buf, img, kind, &walk);
+}
+
+void draw_line(void* img, int x1, int y1, int x2, int y2, color_t c) {
+  if (!initialized) return;
+  render_sync();
+  long long start = stats_start();
+  struct rect clip = {0, 0, line_length - 1, line_count - 1};
+  raster_line(find_buffer(img), img, &clip, x1, y1, x2, y2, c);
+  STATS_ADD(draw_calls, 1);
+  STATS_ADD(primitives, 1);
+  STATS_TIME(draw_ns, start);
+}
+
+/**
+ * A batch of lines queued for the worker pool. Every worker draws the part of
+ * each line inside its own band of scanlines, so workers never write the same
+ * pixel or the same per-scanline damage entry. The damaged scanline range seen
+ * by each worker is merged into the buffer once the batch is retired.
+ */
+struct job {
+  void* img;
+  struct buffer* buf;
+  line_t* lines;
+  int count;
+  struct {
+    int dirty_top;
+    int dirty_bottom;
+    int used_top;
+    int used_bottom;
+  } bounds[MAX_WORKERS];
+};
+
+struct worker {
+  pthread_t thread;
+  int band_top;
+  int band_bottom;
+  unsigned done;  // Number of jobs completed by this worker.
+};
+
+static struct worker workers[MAX_WORKERS];
+static int worker_count;  // Zero when drawing happens on the caller's thread.
+static struct job jobs[MAX_JOBS];
+static unsigned submitted;  // Number of jobs queued so far.
+static unsigned retired;  // Number of jobs merged and freed by the caller.
+static bool stopping = false;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static void* worker_main(void* arg) {
+  struct worker* w = arg;
+  const int index = w - workers;
+  const struct rect band = {0, w->band_top, line_length - 1, w->band_bottom};
+  int i;
+  pthread_mutex_lock(&pool_lock);
+  while (true) {
+    while (!stopping && w->done == submitted) {
+      pthread_cond_wait(&work_cond, &pool_lock);
+    }
+    if (w->done == submitted) break;
+    struct job* job = &jobs[w->done % MAX_JOBS];
+    pthread_mutex_unlock(&pool_lock);
+    // Draw through a view of the buffer that shares the per-scanline damage
+    // arrays but collects the damaged scanline range privately.
+    struct buffer view;
+    struct buffer* target = NULL;
+    if (job->buf) {
+      view.mem = job->img;
+      view.tiled = job->buf->tiled;
+      view.dirty.min_x = job->buf->dirty.min_x;
+      view.dirty.max_x = job->buf->dirty.max_x;
+      view.used.min_x = job->buf->used.min_x;
+      view.used.max_x = job->buf->used.max_x;
+      view.dirty.top = view.used.top = line_count;
+      view.dirty.bottom = view.used.bottom = -1;
+      target = &view;
+    }
+    for (i = 0; i < job->count; ++i) {
+      const line_t* l = &job->lines[i];
+      if ((l->y1 < band.y0 && l->y2 < band.y0) ||
+          (l->y1 > band.y1 && l->y2 > band.y1)) {
+        continue;
+      }
+      raster_line(target, job->img, &band, l->x1, l->y1, l->x2, l->y2,
+                  l->color);
+    }
+    pthread_mutex_lock(&pool_lock);
+    if (target) {
+      job->bounds[index].dirty_top = view.dirty.top;
+      job->bounds[index].dirty_bottom = view.dirty.bottom;
+      job->bounds[index].used_top = view.used.top;
+      job->bounds[index].used_bottom = view.used.bottom;
+    }
+    ++w->done;
+    pthread_cond_broadcast(&done_cond);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+/** Returns the number of jobs completed by every worker. */
+static unsigned jobs_completed() {
+  unsigned done = submitted;
+  int i;
+  for (i = 0; i < worker_count; ++i) {
+    if (submitted - workers[i].done > submitted - done) done = workers[i].done;
+  }
+  return done;
+}
+
+/** Merges and frees the completed jobs. Requires pool_lock. */
+static void retire_jobs() {
+  unsigned done = jobs_completed();
+  int i;
+  for (; retired != done; ++retired) {
+    struct job* job = &jobs[retired % MAX_JOBS];
+    for (i = 0; job->buf && i < worker_count; ++i) {
+      struct damage* dirty = &job->buf->dirty;
+      struct damage* used = &job->buf->used;
+      if (job->bounds[i].dirty_top < dirty->top) {
+        dirty->top = job->bounds[i].dirty_top;
+      }
+      if (job->bounds[i].dirty_bottom > dirty->bottom) {
+        dirty->bottom = job->bounds[i].dirty_bottom;
+      }
+      if (job->bounds[i].used_top < used->top) {
+        used->top = job->bounds[i].used_top;
+      }
+      if (job->bounds[i].used_bottom > used->bottom) {
+        used->bottom = job->bounds[i].used_bottom;
+      }
+    }
+    free(job->lines);
+    job->lines = NULL;
+  }
+}
+
+/** Waits until the workers have drawn every queued batch. */
+static void render_sync() {
+  if (submitted == retired) return;
+  pthread_mutex_lock(&pool_lock);
+  while (jobs_completed() != submitted) {
+    pthread_cond_wait(&done_cond, &pool_lock);
+  }
+  retire_jobs();
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Queues a batch of lines for the workers, returning false when the batch
+ * must be drawn on the caller's thread instead.
+ */
+static bool submit_lines(void* img, const line_t* lines, int count) {
+  line_t* copy = malloc(sizeof(line_t) * count);
+  if (!copy) return false;
+  memcpy(copy, lines, sizeof(line_t) * count);
+  pthread_mutex_lock(&pool_lock);
+  while (submitted - jobs_completed() == MAX_JOBS) {
+    pthread_cond_wait(&done_cond, &pool_lock);
+  }
+  retire_jobs();
+  struct job* job = &jobs[submitted % MAX_JOBS];
+  job->img = img;
+  job->buf = find_buffer(img);
+  job->lines = copy;
+  job->count = count;
+  ++submitted;
+  pthread_cond_broadcast(&work_cond);
+  pthread_mutex_unlock(&pool_lock);
+  return true;
+}
+
+static void stop_workers() {
+  int i;
+  render_sync();
+  pthread_mutex_lock(&pool_lock);
+  stopping = true;
+  pthread_cond_broadcast(&work_cond);
+  pthread_mutex_unlock(&pool_lock);
+  for (i = 0; i < worker_count; ++i) pthread_join(workers[i].thread, NULL);
+  worker_count = 0;
+}
+
+/** Starts the worker pool, splitting the screen into one band per worker. */
+static void start_workers(int count) {
+  int i;
+  if (count > MAX_WORKERS) count = MAX_WORKERS;
+  if (count > line_count) count = line_count;
+  if (count < 2) return;
+  stopping = false;
+  submitted = retired = 0;
+  for (i = 0; i < count; ++i) {
+    workers[i].band_top = line_count * i / count;
+    workers[i].band_bottom = line_count * (i + 1) / count - 1;
+    workers[i].done = 0;
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+      break;
+    }
+    worker_count = i + 1;
+  }
+  if (worker_count < count) stop_workers();
+}
+
+
+/**
+ * Computes the order in which a batch of primitives is drawn: a counting sort
+ * by the band of the topmost scanline of each primitive. Primitives entirely
+ * outside of the screen rows are left out. Returns the number of primitives
+ * in the order, or -1 when the scratch memory cannot be allocated.
+ */
+static int sort_by_band(const int* tops, const int* bottoms, int count,
+                        int** order) {
+  static int* scratch;
+  static int scratch_size;
+  int band_count = ((line_count - 1) >> BAND_SHIFT) + 1;
+  int i;
+  if (scratch_size < count * 2 + band_count + 1) {
+    int* resized = realloc(scratch, sizeof(int) * (count * 2 + band_count + 1));
+    if (!resized) return -1;
+    scratch = resized;
+    scratch_size = count * 2 + band_count + 1;
+  }
+  int* bands = scratch;  // Band of each primitive, or -1 when skipped.
+  int* starts = scratch + count;
+  *order = scratch + count + band_count + 1;
+  memset(starts, 0, sizeof(int) * (band_count + 1));
+  for (i = 0; i < count; ++i) {
+    if (bottoms[i] < 0 || tops[i] >= line_count) {
+      bands[i] = -1;
+      continue;
+    }
+    bands[i] = (tops[i] < 0 ? 0 : tops[i]) >> BAND_SHIFT;
+    ++starts[bands[i] + 1];
+  }
+  for (i = 0; i < band_count; ++i) starts[i + 1] += starts[i];
+  int total = starts[band_count];
+  for (i = 0; i < count; ++i) {
+    if (bands[i] >= 0) (*order)[starts[bands[i]]++] = i;
+  }
+  return total;
+}
+
+static void draw_sorted_lines(void* img, const line_t* lines, int count) {
+  int* tops = malloc(sizeof(int) * count * 2);
+  if (!tops) return;
+  int* bottoms = tops + count;
+  int* order;
+  int i;
+  for (i = 0; i < count; ++i) {
+    const line_t* l = &lines[i];
+    tops[i] = l->y1 < l->y2 ? l->y1 : l->y2;
+    bottoms[i] = l->y1 < l->y2 ? l->y2 : l->y1;
+  }
+  int total = sort_by_band(tops, bottoms, count, &order);
+  free(tops);
+  struct buffer* buf = find_buffer(img);
+  struct rect clip = {0, 0, line_length - 1, line_count - 1};
+  if (total < 0) {
+    // Out of memory for the ordering, so draw in submission order.
+    for (i = 0; i < count; ++i) {
+      const line_t* l = &lines[i];
+      raster_line(buf, img, &clip, l->x1, l->y1, l->x2, l->y2, l->color);
+    }
+    return;
+  }
+  for (i = 0; i < total; ++i) {
+    const line_t* l = &lines[order[i]];
+    raster_line(buf, img, &clip, l->x1, l->y1, l->x2, l->y2, l->color);
+  }
+}
+
+void draw_lines(void* img, const line_t* lines, int count) {
+  if (!initialized || count <= 0) return;
+  long long start = stats_start();
+  STATS_ADD(draw_calls, 1);
+  STATS_ADD(primitives, count);
+  // With workers, each band keeps the submission order, which also makes the
+  // color of overlapping pixels deterministic.
+  if (worker_count == 0 || !submit_lines(img, lines, count)) {
+    render_sync();
+    draw_sorted_lines(img, lines, count);
+  }
+  STATS_TIME(draw_ns, start);
+}
+
+void draw_pixels(void* img, const point_t* points, int count) {
+  if (!initialized || count <= 0) return;
+  render_sync();
+  long long start = stats_start();
+  STATS_ADD(draw_calls, 1);
+  STATS_ADD(primitives, count);
+  int* ys = malloc(sizeof(int) * count);
+  if (!ys) return;
+  int* order;
+  int i;
+  for (i = 0; i < count; ++i) ys[i] = points[i].y;
+  int total = sort_by_band(ys, ys, count, &order);
+  free(ys);
+  struct buffer* buf = find_buffer(img);
+  if (total < 0) {
+    format->put_points(buf, img, points, NULL, count);
+  } else {
+    format->put_points(buf, img, points, order, total);
+  }
+  STATS_TIME(draw_ns, start);
+}
+
+/** A primitive being drawn into a buffer, with its color converted. */
+struct shape {
+  struct buffer* buf;
+  void* img;
+  uint32_t pixel;
+};
+
+/** Fills the pixels [x0, x1] of scanline y, clipped to the screen. */
+static void shape_span(const struct shape* sh, int y, int x0, int x1) {
+  if (y < 0 || y >= line_count) return;
+  if (x0 < 0) x0 = 0;
+  if (x1 >= line_length) x1 = line_length - 1;
+  if (x0 > x1) return;
+  fill_row(sh->buf, sh->img, y, x0, x1 - x0 + 1, sh->pixel);
+  mark_drawn(sh->buf, y, x0, x1);
+  STATS_ADD(pixels, x1 - x0 + 1);
+}
+
+static void shape_pixel(const struct shape* sh, int x, int y) {
+  if (x < 0 || y < 0 || x >= line_length || y >= line_count) return;
+  format->put(pixel_address(sh->buf, sh->img, x, y), sh->pixel);
+  mark_drawn(sh->buf, y, x, x);
+  STATS_ADD(pixels, 1);
+}
+
+/** Sets up a shape, returning false when nothing can be drawn. */
+static bool begin_shape(struct shape* sh, void* img, color_t c) {
+  if (!initialized) return false;
+  render_sync();
+  sh->buf = find_buffer(img);
+  sh->img = img;
+  sh->pixel = native_pixel(c);
+  STATS_ADD(draw_calls, 1);
+  STATS_ADD(primitives, 1);
+  return true;
+}
+
+void draw_circle(void* img, int cx, int cy, int r, color_t c) {
+  struct shape sh;
+  if (r < 0 || !begin_shape(&sh, img, c)) return;
+  long long start = stats_start();
+  int x = r;
+  int y = 0;
+  int err = 1 - r;
+  // Midpoint walk over the octant from (r, 0) to the diagonal.
+  while (x >= y) {
+    shape_pixel(&sh, cx + x, cy + y);
+    shape_pixel(&sh, cx - x, cy + y);
+    shape_pixel(&sh, cx + x, cy - y);
+    shape_pixel(&sh, cx - x, cy - y);
+    shape_pixel(&sh, cx + y, cy + x);
+    shape_pixel(&sh, cx - y, cy + x);
+    shape_pixel(&sh, cx + y, cy - x);
+    shape_pixel(&sh, cx - y, cy - x);
+    ++y;
+    if (err < 0) {
+      err += 2 * y + 1;
+    } else {
+      --x;
+      err += 2 * (y - x) + 1;
+    }
+  }
+  STATS_TIME(draw_ns, start);
+}
+
+void fill_circle(void* img, int cx, int cy, int r, color_t c) {
+  struct shape sh;
+  if (r < 0 || !begin_shape(&sh, img, c)) return;
+  long long start = stats_start();
+  int x = r;
+  int y = 0;
+  int err = 1 - r;
+  // The same walk as draw_circle(), emitting each scanline exactly once: the
+  // rows at +-y right away, and the rows at +-x once the walk leaves them.
+  while (x >= y) {
+    shape_span(&sh, cy + y, cx - x, cx + x);
+    if (y > 0) shape_span(&sh, cy - y, cx - x, cx + x);
+    int last_x = x;
+    int last_y = y;
+    ++y;
+    if (err < 0) {
+      err += 2 * y + 1;
+    } else {
+      --x;
+      err += 2 * (y - x) + 1;
+    }
+    if ((x != last_x || x < y) && last_x > last_y) {
+      shape_span(&sh, cy + last_x, cx - last_y, cx + last_y);
+      shape_span(&sh, cy - last_x, cx - last_y, cx + last_y);
+    }
+  }
+  STATS_TIME(draw_ns, start);
+}
+
+/**
+ * Walks the quadrant of an axis-aligned ellipse from (0, ry) to (rx, 0) with
+ * the integer midpoint algorithm, calling emit for every point. The decision
+ * variables are scaled by four to stay integral, and y never increases.
+ */
+static void walk_ellipse(const struct shape* sh, int cx, int cy, int rx,
+                         int ry, void (*emit)(const struct shape* sh, int cx,
+                                              int cy, int x, int y)) {
+  const long long rx2 = (long long)(rx) * rx;
+  const long long ry2 = (long long)(ry) * ry;
+  long long x = 0;
+  long long y = ry;
+  long long p = 4 * ry2 - 4 * rx2 * ry + rx2;
+  // Region 1: the slope is shallower than -1, so x advances every step.
+  while (ry2 * x < rx2 * y) {
+    emit(sh, cx, cy, x, y);
+    ++x;
+    if (p < 0) {
+      p += 4 * (2 * ry2 * x + ry2);
+    } else {
+      --y;
+      p += 4 * (2 * ry2 * x - 2 * rx2 * y + ry2);
+    }
+  }
+  // Region 2: y advances every step.
+  p = 4 * ry2 * (x * x + x) + ry2 + 4 * rx2 * (y - 1) * (y - 1) -
+      4 * rx2 * ry2;
+  while (y >= 0) {
+    emit(sh, cx, cy, x, y);
+    --y;
+    if (p > 0) {
+      p += 4 * (rx2 - 2 * rx2 * y);
+    } else {
+      ++x;
+      p += 4 * (2 * ry2 * x - 2 * rx2 * y + rx2);
+    }
+  }
+}
+
+static void emit_ellipse_outline(const struct shape* sh, int cx, int cy,
+                                 int x, int y) {
+  shape_pixel(sh, cx + x, cy + y);
+  shape_pixel(sh, cx - x, cy + y);
+  shape_pixel(sh, cx + x, cy - y);
+  shape_pixel(sh, cx - x, cy - y);
+}
+
+// Scanline being collected by emit_ellipse_span(), and its widest x so far.
+static int ellipse_row;
+static int ellipse_row_x;
+
+static void flush_ellipse_row(const struct shape* sh, int cx, int cy) {
+  shape_span(sh, cy + ellipse_row, cx - ellipse_row_x, cx + ellipse_row_x);
+  if (ellipse_row > 0) {
+    shape_span(sh, cy - ellipse_row, cx - ellipse_row_x, cx + ellipse_row_x);
+  }
+}
+
+static void emit_ellipse_span(const struct shape* sh, int cx, int cy, int x,
+                              int y) {
+  if (y != ellipse_row) {
+    flush_ellipse_row(sh, cx, cy);
+    ellipse_row = y;
+  }
+  ellipse_row_x = x;
+}
+
+void draw_ellipse(void* img, int cx, int cy, int rx, int ry, color_t c) {
+  struct shape sh;
+  if (rx < 0 || ry < 0 || !begin_shape(&sh, img, c)) return;
+  long long start = stats_start();
+  walk_ellipse(&sh, cx, cy, rx, ry, emit_ellipse_outline);
+  STATS_TIME(draw_ns, start);
+}
+
+void fill_ellipse(void* img, int cx, int cy, int rx, int ry, color_t c) {
+  struct shape sh;
+  if (rx < 0 || ry < 0 || !begin_shape(&sh, img, c)) return;
+  long long start = stats_start();
+  ellipse_row = ry;
+  ellipse_row_x = 0;
+  walk_ellipse(&sh, cx, cy, rx, ry, emit_ellipse_span);
+  flush_ellipse_row(&sh, cx, cy);
+  STATS_TIME(draw_ns, start);
+}
+
+/**
+ * A non-horizontal polygon edge covering scanlines [y_top, y_bottom). Its x
+ * at the current scanline is x + remainder / dy exactly, with the remainder
+ * kept in [0, dy).
+ */
+struct edge {
+  int y_top;
+  int y_bottom;
+  long long x;
+  long long remainder;
+  long long dy;
+  long long step;  // Whole pixels x moves per scanline.
+  long long step_remainder;
+};
+
+/** Moves an edge to scanline y by solving for x directly. */
+static void edge_seek(struct edge* e, const vertex_t* top, long long dx,
+                      int y) {
+  long long numerator = dx * (y - top->y);
+  e->x = top->x + floor_div(numerator, e->dy);
+  e->remainder = numerator - floor_div(numerator, e->dy) * e->dy;
+}
+
+static int compare_edges_by_top(const void* a, const void* b) {
+  return ((const struct edge*)(a))->y_top - ((const struct edge*)(b))->y_top;
+}
+
+void fill_polygon(void* img, const vertex_t* vertices, int count, color_t c) {
+  struct shape sh;
+  int i;
+  if (count < 3 || !begin_shape(&sh, img, c)) return;
+  long long start = stats_start();
+  struct edge* edges = malloc(sizeof(struct edge) * count * 2);
+  if (!edges) return;
+  struct edge** active = (struct edge**)(edges + count);
+  int edge_count = 0;
+  // Edge table, sorted by the first scanline of each edge. Scanlines are
+  // sampled at integer y with the top vertex included and the bottom one
+  // excluded, so shared vertices are counted once.
+  for (i = 0; i < count; ++i) {
+    const vertex_t* a = &vertices[i];
+    const vertex_t* b = &vertices[(i + 1) % count];
+    if (a->y == b->y) continue;
+    const vertex_t* top = a->y < b->y ? a : b;
+    const vertex_t* bottom = a->y < b->y ? b : a;
+    struct edge* e = &edges[edge_count];
+    long long dx = bottom->x - top->x;
+    e->y_top = top->y < 0 ? 0 : top->y;
+    e->y_bottom = bottom->y < line_count ? bottom->y : line_count;
+    if (e->y_top >= e->y_bottom) continue;
+    e->dy = bottom->y - top->y;
+    e->step = floor_div(dx, e->dy);
+    e->step_remainder = dx - e->step * e->dy;
+    edge_seek(e, top, dx, e->y_top);
+    ++edge_count;
+  }
+  qsort(edges, edge_count, sizeof(struct edge), compare_edges_by_top);
+  int next = 0;
+  int active_count = 0;
+  int y = edge_count > 0 ? edges[0].y_top : 0;
+  while (next < edge_count || active_count > 0) {
+    if (active_count == 0 && edges[next].y_top > y) y = edges[next].y_top;
+    // Add the edges starting on this scanline and drop the finished ones.
+    while (next < edge_count && edges[next].y_top == y) {
+      active[active_count++] = &edges[next++];
+    }
+    int kept = 0;
+    for (i = 0; i < active_count; ++i) {
+      if (active[i]->y_bottom > y) active[kept++] = active[i];
+    }
+    active_count = kept;
+    // Insertion sort by x, which is nearly sorted from the last scanline.
+    for (i = 1; i < active_count; ++i) {
+      struct edge* e = active[i];
+      int j = i;
+      while (j > 0 && (active[j - 1]->x > e->x ||
+                       (active[j - 1]->x == e->x &&
+                        active[j - 1]->remainder * e->dy >
+                            e->remainder * active[j - 1]->dy))) {
+        active[j] = active[j - 1];
+        --j;
+      }
+      active[j] = e;
+    }
+    // Even-odd rule: fill the pixels whose x lies in [left, right).
+    for (i = 0; i + 1 < active_count; i += 2) {
+      long long left = active[i]->x + (active[i]->remainder > 0);
+      long long right = active[i + 1]->x + (active[i + 1]->remainder > 0);
+      if (left < right && right > 0 && left < line_length) {
+        shape_span(&sh, y, left < 0 ? 0 : left,
+                   right > line_length ? line_length - 1 : right - 1);
+      }
+    }
+    for (i = 0; i < active_count; ++i) {
+      struct edge* e = active[i];
+      e->x += e->step;
+      e->remainder += e->step_remainder;
+      if (e->remainder >= e->dy) {
+        e->remainder -= e->dy;
+        ++e->x;
+      }
+    }
+    ++y;
+  }
+  free(edges);
+  STATS_TIME(draw_ns, start);
+}
+
+void sync_graphics() {
+  if (!initialized) return;
+  render_sync();
+}
+
+/**
+ * Maps the memory of an offscreen buffer with every page faulted in up front,
+ * preferring huge pages, so that drawing never takes first-touch faults and
+ * needs few TLB entries. Returns NULL on failure.
+ */
+static void* map_buffer(size_t size, size_t* map_size) {
+  void* mem;
+#ifdef MAP_HUGETLB
+  // Only succeeds when the administrator reserved huge pages.
+  *map_size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+  mem = mmap(NULL, *map_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+  if (mem != MAP_FAILED) return mem;
+#endif
+  *map_size = size;
+#ifdef MADV_HUGEPAGE
+  // Transparent huge pages must be requested before the pages are faulted,
+  // so populate by touching every page after the advice.
+  mem = mmap(NULL, *map_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return NULL;
+  madvise(mem, *map_size, MADV_HUGEPAGE);
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t offset;
+  for (offset = 0; offset < *map_size; offset += page) {
+    *((volatile char*)(mem) + offset) = 0;
+  }
+#else
+  mem = mmap(NULL, *map_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (mem == MAP_FAILED) return NULL;
+#endif
+  return mem;
+}
+
+void* new_offscreen_buffer() {
+  if (!initialized) return NULL;
+  int i;
+  // Recycle a pooled buffer, clearing only what was drawn into it.
+  for (i = 0; i < MAX_BUFFERS; ++i) {
+    struct buffer* buf = &buffers[i];
+    if (!buf->mem || !buf->pooled) continue;
+    render_sync();
+    damage_apply(&buf->used, buf->mem, NULL);
+    damage_reset(&buf->used);
+    damage_reset(&buf->dirty);
+    buf->pooled = false;
+    --pooled_count;
+    return buf->mem;
+  }
+  size_t map_size;
+  void* ob_mem = map_buffer(fb_size, &map_size);
+  if (!ob_mem) return NULL;
+  struct buffer* buf = register_buffer(ob_mem);
+  if (buf) {
+    buf->map_size = map_size;
+  } else if (map_size != fb_size) {
+    // Untracked buffers are unmapped assuming the default size.
+    munmap(ob_mem, map_size);
+    ob_mem = mmap(NULL, fb_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (ob_mem == MAP_FAILED) return NULL;
+  }
+  // Without a free registry slot the buffer still works, it is just always
+  // blitted as a whole.
+  return ob_mem;
+}
+
+void* new_tiled_offscreen_buffer() {
+  if (!initialized) return NULL;
+  size_t map_size;
+  void* mem = map_buffer(tiled_size, &map_size);
+  if (!mem) return NULL;
+  // Only registered buffers are known to be tiled.
+  struct buffer* buf = register_buffer(mem);
+  if (!buf) {
+    munmap(mem, map_size);
+    return NULL;
+  }
+  buf->map_size = map_size;
+  buf->tiled = true;
+  return mem;
+}
+
+void free_offscreen_buffer(void* img) {
+  if (!initialized || !img) return;
+  render_sync();
+  // A pooled buffer comes back cleared with its damage reset, so neither
+  // the screen nor the capture can be diffed against it by damage.
+  if (img == last_blitted) last_blitted = NULL;
+  if (img == capture_last) capture_last = NULL;
+  if (img == fallback_back_buffer) fallback_back_buffer = NULL;
+  drop_layer(img);
+  struct buffer* buf = find_buffer(img);
+  if (!buf) {
+    munmap(img, fb_size);
+    return;
+  }
+  if (!buf->map_size || buf->pooled) return;  // Pages or already freed.
+  if (pooled_count < MAX_POOLED && !buf->tiled) {
+    buf->pooled = true;
+    ++pooled_count;
+    return;
+  }
+  munmap(buf->mem, buf->map_size);
+  unregister_buffer(buf);
+}
+
+void* get_back_buffer() {
+  if (!initialized) return NULL;
+  if (page_count > 0) return pages[(shown_page + 1) % page_count];
+  if (!fallback_back_buffer) fallback_back_buffer = new_offscreen_buffer();
+  return fallback_back_buffer;
+}
+
+void set_vsync(int enabled) {
+  vsync_enabled = enabled ? true : false;
+}
+
+/** Shows a buffer on the screen, returning the number of bytes copied. */
+static size_t present(void* src) {
+  size_t copied = fb_size;
+  int i;
+  for (i = 0; i < page_count; ++i) {
+    if (src != pages[i]) continue;
+    if (i == shown_page || pan_to_page(i)) {
+      last_blitted = src;
+      return 0;
+    }
+    // Panning failed, so stop flipping and present the page by copying.
+    page_count = 0;
+    break;
+  }
+  struct buffer* buf = find_buffer(src);
+  if (!buf) {
+    copy_kernel(screen_mem, src, fb_size);
+  } else if (buf->tiled) {
+    copied = tiled_apply(src == last_blitted ? &buf->dirty : NULL,
+                         screen_mem, src);
+    damage_reset(&buf->dirty);
+  } else {
+    if (src == last_blitted) {
+      copied = damage_apply(&buf->dirty, screen_mem, src);
+    } else {
+      // The screen holds other content, so every pixel may differ.
+      copy_kernel(screen_mem, src, fb_size);
+    }
+    damage_reset(&buf->dirty);
+  }
+  last_blitted = src;
+  return copied;
+}
+
+/** Records the interval since the previous frame in the stats. */
+static void record_frame(long long now) {
+  if (last_frame_ns) {
+    unsigned long long interval = now - last_frame_ns;
+    unsigned slot = __atomic_fetch_add(&frame_ring_next, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&frame_ring[slot % FRAME_RING_SIZE], interval,
+                     __ATOMIC_RELAXED);
+    int bucket = 0;
+    unsigned long long us = interval / 1000;
+    while (us > 1 && bucket < GRAPHICS_STATS_BUCKETS - 1) {
+      us >>= 1;
+      ++bucket;
+    }
+    STATS_ADD(frame_histogram[bucket], 1);
+  }
+  last_frame_ns = now;
+  STATS_ADD(frames, 1);
+}
+
+/*
+ * Frame capture. Every presented frame is compared with the previous one and
+ * only the changed runs of pixels are written, see start_capture() for the
+ * file format. Runs are found in the frame as one array of pixels, so they
+ * may span scanlines, and short unchanged gaps are kept inside a run when
+ * they cost less than a new run header.
+ */
+#define CAPTURE_RUN_HEADER 8
+#define CAPTURE_MIN_FILL 8  // Repeated pixels worth a fill run.
+#define CAPTURE_FILL 0x80000000u
+
+static FILE* capture_file;
+static char* capture_prev;  // The last captured frame.
+static uint8_t* capture_out;  // Encoding of the frame being captured.
+static size_t capture_size;
+static size_t capture_capacity;
+static unsigned capture_runs;
+
+static void put_le(uint8_t* p, uint64_t value, int size) {
+  int i;
+  for (i = 0; i < size; ++i) p[i] = value >> (8 * i);
+}
+
+static bool capture_reserve(size_t size) {
+  if (capture_size + size <= capture_capacity) return true;
+  size_t capacity = capture_capacity * 2;
+  if (capacity < capture_size + size) capacity = capture_size + size;
+  uint8_t* out = realloc(capture_out, capacity);
+  if (!out) return false;
+  capture_out = out;
+  capture_capacity = capacity;
+  return true;
+}
+
+/** Appends a run of count pixels at a pixel offset, or a fill of one. */
+static bool capture_run(size_t offset, size_t count, const char* pixels,
+                        bool fill) {
+  size_t data = fill ? bytes_per_pixel : count * bytes_per_pixel;
+  if (!capture_reserve(CAPTURE_RUN_HEADER + data)) return false;
+  uint8_t* p = capture_out + capture_size;
+  put_le(p, offset, 4);
+  put_le(p + 4, count | (fill ? CAPTURE_FILL : 0), 4);
+  memcpy(p + CAPTURE_RUN_HEADER, pixels, data);
+  capture_size += CAPTURE_RUN_HEADER + data;
+  ++capture_runs;
+  return true;
+}
+
+/** Encodes the changed pixels [start, end), with fills for repeats. */
+static bool capture_span(const char* frame, size_t start, size_t end) {
+  const int size = bytes_per_pixel;
+  size_t literal = start;
+  size_t i = start;
+  while (i < end) {
+    const uint32_t pixel = pixel_at(frame, i);
+    size_t repeat = 1;
+    while (i + repeat < end && pixel_at(frame, i + repeat) == pixel) ++repeat;
+    if (repeat < CAPTURE_MIN_FILL) {
+      i += repeat;
+      continue;
+    }
+    if (literal < i &&
+        !capture_run(literal, i - literal, frame + literal * size, false)) {
+      return false;
+    }
+    if (!capture_run(i, repeat, frame + i * size, true)) return false;
+    i += repeat;
+    literal = i;
+  }
+  return literal == end ||
+      capture_run(literal, end - literal, frame + literal * size, false);
+}
+
+/** Encodes the pixels in [pos, to) that differ from the previous frame. */
+static bool capture_range(const char* frame, size_t pos, size_t to) {
+  const int size = bytes_per_pixel;
+  const size_t max_gap = CAPTURE_RUN_HEADER / size;
+  while (pos < to) {
+    pos += mismatch_kernel(capture_prev + pos * size, frame + pos * size,
+                           (to - pos) * size) / size;
+    if (pos >= to) break;
+    size_t end = pos + 1;
+    size_t i;
+    for (i = end; i < to && i - end < max_gap; ++i) {
+      if (pixel_at(capture_prev, i) != pixel_at(frame, i)) end = i + 1;
+    }
+    if (!capture_span(frame, pos, end)) return false;
+    memcpy(capture_prev + pos * size, frame + pos * size, (end - pos) * size);
+    pos = end;
+  }
+  return true;
+}
+
+/**
+ * Writes the difference between a frame about to be presented and the
+ * previous one. When the same buffer was captured last, only its damage
+ * since then can differ, so only that is compared.
+ */
+static void capture_frame(void* frame) {
+  struct buffer* buf = frame == capture_last ? find_buffer(frame) : NULL;
+  long long start = stats_start();
+  bool written = true;
+  int y;
+  capture_size = 16;
+  capture_runs = 0;
+  if (buf) {
+    const struct damage* d = &buf->dirty;
+    for (y = d->top; y <= d->bottom && written; ++y) {
+      if (d->min_x[y] > d->max_x[y]) continue;
+      size_t row = (size_t)(y) * line_length;
+      written = capture_range(frame, row + d->min_x[y], row + d->max_x[y] + 1);
+    }
+  } else {
+    written = capture_range(frame, 0, (size_t)(line_length) * line_count);
+  }
+  memcpy(capture_out, "FRME", 4);
+  put_le(capture_out + 4, graphics_clock_ns(), 8);
+  put_le(capture_out + 12, capture_runs, 4);
+  if (!written ||
+      fwrite(capture_out, 1, capture_size, capture_file) != capture_size) {
+    stop_capture();
+    return;
+  }
+  capture_last = frame;
+  STATS_ADD(capture_bytes, capture_size);
+  STATS_TIME(capture_ns, start);
+}
+
+int start_capture(const char* path) {
+  uint8_t header[28];
+  if (!initialized || capture_file) return -1;
+  capture_prev = calloc(fb_size, 1);
+  capture_capacity = fb_size + 4096;
+  capture_out = malloc(capture_capacity);
+  capture_file = fopen(path, "wb");
+  memcpy(header, "GCAP", 4);
+  put_le(header + 4, 1, 4);
+  put_le(header + 8, line_length, 4);
+  put_le(header + 12, line_count, 4);
+  put_le(header + 16, var_info.xres, 4);
+  header[20] = bytes_per_pixel;
+  header[21] = var_info.red.offset;
+  header[22] = var_info.red.length;
+  header[23] = var_info.green.offset;
+  header[24] = var_info.green.length;
+  header[25] = var_info.blue.offset;
+  header[26] = var_info.blue.length;
+  header[27] = 0;
+  if (!capture_prev || !capture_out || !capture_file ||
+      fwrite(header, 1, sizeof(header), capture_file) != sizeof(header)) {
+    stop_capture();
+    return -1;
+  }
+  return 0;
+}
+
+void stop_capture() {
+  if (capture_file) fclose(capture_file);
+  capture_file = NULL;
+  free(capture_prev);
+  capture_prev = NULL;
+  free(capture_out);
+  capture_out = NULL;
+  capture_capacity = 0;
+  capture_last = NULL;
+}
+
+// Serializes present() between blit() and the present thread.
+static pthread_mutex_t present_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Presents a buffer whose drawing is complete, with its stats. */
+static void show_frame(void* src) {
+  pthread_mutex_lock(&present_lock);
+  const bool tiled = is_tiled(src);
+  // Captured before presenting, which resets the damage of the buffer. A
+  // tiled buffer is captured from the screen it is copied to instead.
+  if (capture_file && !tiled) capture_frame(src);
+  long long start = stats_start();
+  size_t copied = present(src);
+  if (backend->show) backend->show(screen_mem);
+  if (stats_mode) {
+    long long end = graphics_clock_ns();
+    STATS_ADD(blit_ns, end - start);
+    STATS_ADD(bytes_blitted, copied);
+    record_frame(end);
+  }
+  if (capture_file && tiled) {
+    capture_last = NULL;
+    capture_frame(screen_mem);
+  }
+  pthread_mutex_unlock(&present_lock);
+}
+
+void blit(void *src) {
+  if (!initialized) return;
+  render_sync();
+  show_frame(src);
+}
+
+/*
+ * The swap chain of present_frame(). Its buffers are the pages of video
+ * memory when there are enough of them, so that presenting is a flip, and
+ * offscreen buffers copied to the screen otherwise. A buffer goes from free
+ * to drawing in acquire_frame(), is queued by present_frame() and presented
+ * by the present thread, after which it is free again, or shown until the
+ * next flip. The state is guarded by chain_lock.
+ */
+enum frame_state { FRAME_FREE, FRAME_DRAWING, FRAME_QUEUED, FRAME_SHOWN };
+
+static void* chain[CHAIN_LENGTH];
+static enum frame_state chain_state[CHAIN_LENGTH];
+static bool chain_flips;
+static int present_queue[CHAIN_LENGTH];  // Chain slots, in order.
+static unsigned queued;  // Frames ever queued.
+static unsigned presented;  // Frames whose present completed.
+static int max_queued = 1;
+static bool present_running;
+static bool present_stopping;
+static pthread_t present_thread;
+static pthread_mutex_t chain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chain_cond = PTHREAD_COND_INITIALIZER;
+
+static void* present_main(void* arg) {
+  pthread_mutex_lock(&chain_lock);
+  for (;;) {
+    while (presented == queued && !present_stopping) {
+      pthread_cond_wait(&chain_cond, &chain_lock);
+    }
+    // Queued frames are still shown when stopping.
+    if (presented == queued) break;
+    int slot = present_queue[presented % CHAIN_LENGTH];
+    pthread_mutex_unlock(&chain_lock);
+    show_frame(chain[slot]);
+    pthread_mutex_lock(&chain_lock);
+    ++presented;
+    if (chain_flips) {
+      int i;
+      for (i = 0; i < CHAIN_LENGTH; ++i) {
+        if (chain_state[i] == FRAME_SHOWN) chain_state[i] = FRAME_FREE;
+      }
+      chain_state[slot] = FRAME_SHOWN;
+    } else {
+      chain_state[slot] = FRAME_FREE;
+    }
+    pthread_cond_broadcast(&chain_cond);
+  }
+  pthread_mutex_unlock(&chain_lock);
+  return NULL;
+}
+
+/** Sets up the swap chain and starts the present thread. */
+static bool start_present_thread() {
+  int i;
+  chain_flips = page_count >= CHAIN_LENGTH;
+  for (i = 0; i < CHAIN_LENGTH; ++i) {
+    if (chain_flips) {
+      chain[i] = pages[i];
+      chain_state[i] = i == shown_page ? FRAME_SHOWN : FRAME_FREE;
+    } else {
+      chain[i] = new_offscreen_buffer();
+      chain_state[i] = FRAME_FREE;
+      if (!chain[i]) return false;
+    }
+  }
+  queued = presented = 0;
+  present_stopping = false;
+  if (pthread_create(&present_thread, NULL, present_main, NULL) != 0) {
+    return false;
+  }
+  present_running = true;
+  return true;
+}
+
+/** Presents the frames still queued and stops the present thread. */
+static void stop_present_thread() {
+  int i;
+  if (!present_running) return;
+  pthread_mutex_lock(&chain_lock);
+  present_stopping = true;
+  pthread_cond_broadcast(&chain_cond);
+  pthread_mutex_unlock(&chain_lock);
+  pthread_join(present_thread, NULL);
+  present_running = false;
+  for (i = 0; i < CHAIN_LENGTH; ++i) {
+    if (!chain_flips) free_offscreen_buffer(chain[i]);
+    chain[i] = NULL;
+  }
+}
+
+void* acquire_frame() {
+  if (!initialized) return NULL;
+  if (!present_running && !start_present_thread()) return NULL;
+  long long start = stats_start();
+  void* img = NULL;
+  pthread_mutex_lock(&chain_lock);
+  for (;;) {
+    int i;
+    bool pending = false;
+    for (i = 0; i < CHAIN_LENGTH && !img; ++i) {
+      if (chain_state[i] == FRAME_FREE) {
+        chain_state[i] = FRAME_DRAWING;
+        img = chain[i];
+      }
+      if (chain_state[i] == FRAME_QUEUED) pending = true;
+    }
+    // Only a queued frame can free a buffer, so do not wait without one.
+    if (img || !pending) break;
+    pthread_cond_wait(&chain_cond, &chain_lock);
+  }
+  pthread_mutex_unlock(&chain_lock);
+  STATS_TIME(queue_wait_ns, start);
+  return img;
+}
+
+void present_frame(void* img) {
+  int slot;
+  if (!initialized || !present_running) return;
+  for (slot = 0; slot < CHAIN_LENGTH && chain[slot] != img; ++slot) {}
+  if (slot == CHAIN_LENGTH) return;
+  render_sync();
+  long long start = stats_start();
+  pthread_mutex_lock(&chain_lock);
+  if (chain_state[slot] != FRAME_DRAWING) {
+    pthread_mutex_unlock(&chain_lock);
+    return;
+  }
+  while ((int)(queued - presented) >= max_queued) {
+    pthread_cond_wait(&chain_cond, &chain_lock);
+  }
+  chain_state[slot] = FRAME_QUEUED;
+  present_queue[queued % CHAIN_LENGTH] = slot;
+  ++queued;
+  STATS_ADD(frames_queued, 1);
+  STATS_ADD(queue_depth_sum, queued - presented);
+  pthread_cond_broadcast(&chain_cond);
+  pthread_mutex_unlock(&chain_lock);
+  STATS_TIME(queue_wait_ns, start);
+}
+
+int get_present_queue_depth() {
+  pthread_mutex_lock(&chain_lock);
+  int depth = queued - presented;
+  pthread_mutex_unlock(&chain_lock);
+  return depth;
+}
+
+void set_max_queued_frames(int frames) {
+  if (frames < 1) frames = 1;
+  if (frames > CHAIN_LENGTH - 1) frames = CHAIN_LENGTH - 1;
+  pthread_mutex_lock(&chain_lock);
+  max_queued = frames;
+  pthread_cond_broadcast(&chain_cond);
+  pthread_mutex_unlock(&chain_lock);
+}
+
+/**
+ * A line as recorded in a display list: the walk left by clip_line(), packed
+ * since scanline coordinates and counts fit in 16 bits. Points and spans only
+ * use the fields up to pixel.
+ */
+struct __attribute__((packed)) recorded_line {
+  uint8_t kind;
+  int16_t x;
+  int16_t y;
+  uint16_t count;
+  uint32_t pixel;
+  int8_t sx;
+  int8_t sy;
+  int32_t numerator;
+  int32_t longest;
+  int32_t shortest;
+};
+
+#define SHORT_RECORD_SIZE offsetof(struct recorded_line, sx)
+
+/**
+ * Primitives recorded already converted, transformed and clipped to the
+ * screen, and a cached rasterization of them. The cache is filled with a
+ * pixel value that no primitive uses, so that it can be copied with that
+ * value as a color key, and raster.used tracks what was drawn in it.
+ */
+struct display_list {
+  uint8_t* records;
+  size_t size;
+  size_t capacity;
+  bool cached;  // Whether the cache holds the current records.
+  uint32_t key;
+  struct buffer raster;  // Unregistered, with raster.mem the cache.
+};
+
+display_list_t* new_display_list() {
+  return calloc(1, sizeof(struct display_list));
+}
+
+void free_display_list(display_list_t* list) {
+  if (!list) return;
+  if (list->raster.mem) {
+    munmap(list->raster.mem, list->raster.map_size);
+    free(list->raster.dirty.min_x);
+    free(list->raster.used.min_x);
+  }
+  free(list->records);
+  free(list);
+}
+
+void reset_display_list(display_list_t* list) {
+  list->size = 0;
+  list->cached = false;
+}
+
+static void append_record(struct display_list* list, enum line_kind kind,
+                          const struct walk* walk) {
+  size_t size = kind == LINE_X_MAJOR || kind == LINE_COLUMN ||
+      kind == LINE_Y_MAJOR ? sizeof(struct recorded_line) : SHORT_RECORD_SIZE;
+  if (list->size + size > list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 4096;
+    uint8_t* records = realloc(list->records, capacity);
+    if (!records) return;
+    list->records = records;
+    list->capacity = capacity;
+  }
+  struct recorded_line r = {
+    kind, walk->x, walk->y, walk->count, walk->pixel, walk->sx, walk->sy,
+    walk->numerator, walk->longest, walk->shortest
+  };
+  memcpy(list->records + list->size, &r, size);
+  list->size += size;
+  list->cached = false;
+}
+
+void record_line(display_list_t* list, int x1, int y1, int x2, int y2,
+                 color_t c) {
+  if (!initialized || !list) return;
+  struct rect clip = {0, 0, line_length - 1, line_count - 1};
+  struct walk walk;
+  enum line_kind kind = clip_line(&clip, x1, y1, x2, y2, native_pixel(c),
+                                  &walk);
+  if (kind != LINE_NONE) append_record(list, kind, &walk);
+}
+
+void record_lines(display_list_t* list, const line_t* lines, int count) {
+  int i;
+  for (i = 0; i < count; ++i) {
+    const line_t* l = &lines[i];
+    record_line(list, l->x1, l->y1, l->x2, l->y2, l->color);
+  }
+}
+
+void record_pixel(display_list_t* list, int x, int y, color_t c) {
+  record_line(list, x, y, x, y, c);
+}
+
+/** Draws every record of a list into a buffer, returning the count. */
+static long long replay_records(const struct display_list* list,
+                                struct buffer* buf, void* img) {
+  size_t offset = 0;
+  long long count = 0;
+  while (offset < list->size) {
+    struct recorded_line r;
+    enum line_kind kind = list->records[offset];
+    size_t size = kind == LINE_POINT || kind == LINE_SPAN ?
+        SHORT_RECORD_SIZE : sizeof(struct recorded_line);
+    memcpy(&r, list->records + offset, size);
+    offset += size;
+    struct walk walk = {
+      NULL, r.x, r.y, 1, 1, r.count, 0, 0, 0, r.pixel
+    };
+    if (size == sizeof(struct recorded_line)) {
+      walk.sx = r.sx;
+      walk.sy = r.sy;
+      walk.numerator = r.numerator;
+      walk.longest = r.longest;
+      walk.shortest = r.shortest;
+    }
+    draw_walk(buf, img, kind, &walk);
+    ++count;
+  }
+  return count;
+}
+
+static int compare_pixels(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)(a);
+  uint32_t y = *(const uint32_t*)(b);
+  return (x > y) - (x < y);
+}
+
+/** Finds the smallest pixel value not used by any record. */
+static bool pick_key(const struct display_list* list, uint32_t* key) {
+  uint32_t* pixels = malloc(list->size / SHORT_RECORD_SIZE * 4 + 4);
+  size_t count = 0;
+  size_t offset = 0;
+  size_t i;
+  if (!pixels) return false;
+  while (offset < list->size) {
+    struct recorded_line r;
+    memcpy(&r, list->records + offset, SHORT_RECORD_SIZE);
+    pixels[count++] = r.pixel;
+    offset += r.kind == LINE_POINT || r.kind == LINE_SPAN ?
+        SHORT_RECORD_SIZE : sizeof(struct recorded_line);
+  }
+  qsort(pixels, count, sizeof(uint32_t), compare_pixels);
+  *key = 0;
+  for (i = 0; i < count && pixels[i] <= *key; ++i) {
+    if (pixels[i] == *key) ++*key;
+  }
+  free(pixels);
+  return true;
+}
+
+/** Rasterizes a list into its cache, returning false if there is none. */
+static bool build_cache(struct display_list* list) {
+  struct buffer* raster = &list->raster;
+  int y;
+  if (!raster->mem) {
+    raster->mem = map_buffer(fb_size, &raster->map_size);
+    if (!raster->mem) return false;
+    if (!damage_init(&raster->dirty) || !damage_init(&raster->used)) {
+      munmap(raster->mem, raster->map_size);
+      raster->mem = NULL;
+      return false;
+    }
+    damage_fill(&raster->used);
+  }
+  uint32_t old_key = list->key;
+  if (!pick_key(list, &list->key)) return false;
+  // Put the key back where the previous rasterization drew, or everywhere
+  // if the key changed.
+  if (list->key != old_key) damage_fill(&raster->used);
+  for (y = raster->used.top; y <= raster->used.bottom; ++y) {
+    if (raster->used.min_x[y] > raster->used.max_x[y]) continue;
+    format->fill_span((char*)(raster->mem) + y * stride +
+                          raster->used.min_x[y] * bytes_per_pixel,
+                      list->key,
+                      raster->used.max_x[y] - raster->used.min_x[y] + 1);
+  }
+  damage_reset(&raster->used);
+  replay_records(list, raster, raster->mem);
+  damage_reset(&raster->dirty);
+  list->cached = true;
+  return true;
+}
+
+/** Copies the drawn part of the cache to img, moved by (dx, dy). */
+static long long copy_cache(const struct display_list* list, void* img,
+                            int dx, int dy) {
+  const struct damage* used = &list->raster.used;
+  struct buffer* buf = find_buffer(img);
+  long long copied = 0;
+  int y;
+  for (y = used->top; y <= used->bottom; ++y) {
+    int x0 = used->min_x[y] + dx;
+    int x1 = used->max_x[y] + dx;
+    if (used->min_x[y] > used->max_x[y]) continue;
+    if (y + dy < 0 || y + dy >= line_count) continue;
+    if (x0 < 0) x0 = 0;
+    if (x1 >= line_length) x1 = line_length - 1;
+    if (x0 > x1) continue;
+    keyed_kernel((char*)(img) + (y + dy) * stride + x0 * bytes_per_pixel,
+                 (const char*)(list->raster.mem) + y * stride +
+                     (x0 - dx) * bytes_per_pixel,
+                 x1 - x0 + 1, bytes_per_pixel, list->key);
+    mark_drawn(buf, y + dy, x0, x1);
+    copied += x1 - x0 + 1;
+  }
+  return copied;
+}
+
+int draw_display_list(void* img, display_list_t* list, int dx, int dy) {
+  if (!initialized || !img || !list || is_tiled(img)) return -1;
+  render_sync();
+  long long start = stats_start();
+  int result = 0;
+  if (list->cached || build_cache(list)) {
+    long long copied = copy_cache(list, img, dx, dy);
+    STATS_ADD(pixels, copied);
+  } else if (dx == 0 && dy == 0) {
+    long long replayed = replay_records(list, find_buffer(img), img);
+    STATS_ADD(primitives, replayed);
+  } else {
+    // The records are clipped for the screen at no offset.
+    result = -1;
+  }
+  STATS_ADD(draw_calls, 1);
+  STATS_TIME(draw_ns, start);
+  return result;
+}
+
+// 4x4 ordered dithering thresholds, from 0 to 15.
+static const uint8_t kBayer[4][4] = {
+  {0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}
+};
+
+/**
+ * Reads a little-endian integer of the given size from a BMP header, which
+ * is stored unaligned.
+ */
+static uint32_t read_le(const uint8_t* p, int size) {
+  uint32_t value = 0;
+  while (size-- > 0) value = value << 8 | p[size];
+  return value;
+}
+
+/** Skips whitespace and comments in a PPM header and reads a number. */
+static bool read_ppm_number(const uint8_t* data, size_t size, size_t* pos,
+                            int* out) {
+  while (*pos < size) {
+    if (data[*pos] == '#') {
+      while (*pos < size && data[*pos] != '\n') ++*pos;
+    } else if (data[*pos] == ' ' || data[*pos] == '\t' ||
+               data[*pos] == '\n' || data[*pos] == '\r') {
+      ++*pos;
+    } else {
+      break;
+    }
+  }
+  if (*pos >= size || data[*pos] < '0' || data[*pos] > '9') return false;
+  long value = 0;
+  while (*pos < size && data[*pos] >= '0' && data[*pos] <= '9') {
+    value = value * 10 + data[(*pos)++] - '0';
+    if (value > 1 << 16) return false;
+  }
+  *out = value;
+  return true;
+}
+
+/** Where the rows of an RGB888 image lie in a file. */
+struct rgb_rows {
+  int width;
+  int height;
+  const uint8_t* first;  // The top row.
+  long row_step;  // Bytes from a row to the one below, negative if bottom-up.
+  struct rgb_layout layout;
+};
+
+/** Parses a binary PPM (P6) with 8-bit channels. */
+static bool parse_ppm(const uint8_t* data, size_t size, struct rgb_rows* rows) {
+  size_t pos = 2;
+  int max_value;
+  if (size < 2 || data[0] != 'P' || data[1] != '6') return false;
+  if (!read_ppm_number(data, size, &pos, &rows->width) ||
+      !read_ppm_number(data, size, &pos, &rows->height) ||
+      !read_ppm_number(data, size, &pos, &max_value) || max_value != 255) {
+    return false;
+  }
+  ++pos;  // The single whitespace before the raster.
+  rows->layout = (struct rgb_layout){3, 0, 1, 2};
+  rows->row_step = (long)(rows->width) * 3;
+  rows->first = data + pos;
+  return pos <= size &&
+      (size - pos) / 3 / (rows->width ? rows->width : 1) >=
+          (size_t)(rows->height);
+}
+
+/** Parses an uncompressed 24 or 32-bit BMP, either bottom-up or top-down. */
+static bool parse_bmp(const uint8_t* data, size_t size, struct rgb_rows* rows) {
+  if (size < 54 || data[0] != 'B' || data[1] != 'M') return false;
+  uint32_t offset = read_le(data + 10, 4);
+  int32_t height = (int32_t)(read_le(data + 22, 4));
+  int bits = read_le(data + 28, 2);
+  if (read_le(data + 30, 4) != 0 || (bits != 24 && bits != 32)) return false;
+  rows->width = (int32_t)(read_le(data + 18, 4));
+  rows->height = height < 0 ? -height : height;
+  if (rows->width < 0 || rows->width > 1 << 16 || rows->height > 1 << 16) {
+    return false;
+  }
+  rows->layout = (struct rgb_layout){bits / 8, 2, 1, 0};
+  // Rows are padded to 4 bytes.
+  long row_size = ((long)(rows->width) * bits / 8 + 3) & ~3L;
+  if (offset > size ||
+      (size - offset) / (row_size ? row_size : 1) < (size_t)(rows->height)) {
+    return false;
+  }
+  if (height < 0) {
+    rows->first = data + offset;
+    rows->row_step = row_size;
+  } else {
+    rows->first = data + offset + (rows->height - 1) * row_size;
+    rows->row_step = -row_size;
+  }
+  return true;
+}
+
+image_t* load_image(const char* path, int flags) {
+  FILE* file = fopen(path, "rb");
+  if (!file) return NULL;
+  uint8_t* data = NULL;
+  long size = -1;
+  if (fseek(file, 0, SEEK_END) == 0) size = ftell(file);
+  if (size > 0 && fseek(file, 0, SEEK_SET) == 0) data = malloc(size);
+  if (data && fread(data, 1, size, file) != (size_t)(size)) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+  if (!data) return NULL;
+  struct rgb_rows rows;
+  image_t* image = NULL;
+  if (parse_ppm(data, size, &rows) || parse_bmp(data, size, &rows)) {
+    image = malloc(sizeof(image_t));
+  }
+  if (image) {
+    image->width = rows.width;
+    image->height = rows.height;
+    image->color_key = NO_COLOR_KEY;
+    image->pixels = malloc(sizeof(color_t) * rows.width * rows.height + 1);
+    if (!image->pixels) {
+      free(image);
+      image = NULL;
+    }
+  }
+  if (image) {
+    if (!convert_kernel) select_kernels();
+    uint8_t dither[4][16];
+    int x;
+    int y;
+    // Per row of the matrix, the thresholds for each channel over 4 pixels:
+    // up to 7 for the 5-bit channels and up to 3 for the 6-bit one.
+    for (y = 0; y < 4; ++y) {
+      for (x = 0; x < 4; ++x) {
+        dither[y][x * 4] = kBayer[y][x] / 2;
+        dither[y][x * 4 + 1] = kBayer[y][x] / 4;
+        dither[y][x * 4 + 2] = kBayer[y][x] / 2;
+        dither[y][x * 4 + 3] = 0;
+      }
+    }
+    for (y = 0; y < rows.height; ++y) {
+      convert_kernel(image->pixels + y * rows.width,
+                     rows.first + y * rows.row_step, rows.width, &rows.layout,
+                     flags & IMAGE_DITHER ? dither[y & 3] : NULL);
+    }
+  }
+  free(data);
+  return image;
+}
+
+void free_image(image_t* image) {
+  if (!image) return;
+  free(image->pixels);
+  free(image);
+}
+
+/**
+ * Clips the source rectangle of a copy to a source of the given size, and the
+ * destination at (x, y) to the screen, moving both together. Returns false if
+ * nothing is left.
+ */
+static bool clip_copy(rect_t* r, int* x, int* y, int width, int height) {
+  if (r->x < 0) { *x -= r->x; r->width += r->x; r->x = 0; }
+  if (r->y < 0) { *y -= r->y; r->height += r->y; r->y = 0; }
+  if (*x < 0) { r->x -= *x; r->width += *x; *x = 0; }
+  if (*y < 0) { r->y -= *y; r->height += *y; *y = 0; }
+  if (r->width > width - r->x) r->width = width - r->x;
+  if (r->height > height - r->y) r->height = height - r->y;
+  if (r->width > line_length - *x) r->width = line_length - *x;
+  if (r->height > line_count - *y) r->height = line_count - *y;
+  return r->width > 0 && r->height > 0;
+}
+
+/**
+ * Copies a row of count native pixels, skipping those equal to key. When dst
+ * is to the right of src on the same row, the left-to-right kernels would
+ * read pixels they already wrote, so the row goes right to left through a
+ * scratch buffer instead.
+ */
+static void keyed_row(char* dst, const char* src, int count, uint32_t key) {
+  char scratch[1536];  // 512 pixels of up to 3 bytes, or 384 of 4.
+  const int chunk = sizeof(scratch) / bytes_per_pixel;
+  int end = count;
+  if (dst <= src || dst >= src + count * bytes_per_pixel) {
+    keyed_kernel(dst, src, count, bytes_per_pixel, key);
+    return;
+  }
+  while (end > 0) {
+    int start = end > chunk ? end - chunk : 0;
+    memcpy(scratch, src + start * bytes_per_pixel,
+           (end - start) * bytes_per_pixel);
+    keyed_kernel(dst + start * bytes_per_pixel, scratch, end - start,
+                 bytes_per_pixel, key);
+    end = start;
+  }
+}
+
+/**
+ * Copies rows of native pixels, skipping those equal to key unless it is
+ * NO_COLOR_KEY. Rows go bottom-up when a buffer is copied onto a lower part
+ * of itself.
+ */
+static void copy_rows(struct buffer* buf, char* dst, const char* src,
+                      int src_stride, int x, int y, const rect_t* r,
+                      int key) {
+  const char* from = src + r->y * src_stride + r->x * bytes_per_pixel;
+  char* to = dst + y * stride + x * bytes_per_pixel;
+  const size_t row_size = r->width * bytes_per_pixel;
+  const uint32_t native_key = key == NO_COLOR_KEY ? 0 : native_pixel(key);
+  bool upward = to > from && to < from + r->height * (long)(src_stride);
+  int i;
+  for (i = 0; i < r->height; ++i) {
+    int row = upward ? r->height - 1 - i : i;
+    if (key == NO_COLOR_KEY) {
+      memmove(to + row * stride, from + row * src_stride, row_size);
+    } else {
+      keyed_row(to + row * stride, from + row * src_stride, r->width,
+                native_key);
+    }
+    mark_drawn(buf, y + row, x, x + r->width - 1);
+  }
+}
+
+void blit_rect(void* dst, int x, int y, const void* src,
+               const rect_t* src_rect, int color_key) {
+  if (!initialized || !dst || !src || is_tiled(dst) || is_tiled(src)) return;
+  render_sync();
+  long long start = stats_start();
+  rect_t r = src_rect ? *src_rect : (rect_t){0, 0, line_length, line_count};
+  if (clip_copy(&r, &x, &y, line_length, line_count)) {
+    copy_rows(find_buffer(dst), dst, src, stride, x, y, &r, color_key);
+    STATS_ADD(pixels, (long long)(r.width) * r.height);
+  }
+  STATS_ADD(draw_calls, 1);
+  STATS_ADD(primitives, 1);
+  STATS_TIME(draw_ns, start);
+}
+
+void draw_image(void* img, int x, int y, const image_t* image,
+                const rect_t* src_rect) {
+  if (!initialized || !img || !image || is_tiled(img)) return;
+  render_sync();
+  long long start = stats_start();
+  rect_t r = src_rect ? *src_rect : (rect_t){0, 0, image->width, image->height};
+  if (clip_copy(&r, &x, &y, image->width, image->height)) {
+    struct buffer* buf = find_buffer(img);
+    if (native_rgb565) {
+      copy_rows(buf, img, (const char*)(image->pixels),
+                image->width * sizeof(color_t), x, y, &r, image->color_key);
+    } else {
+      int i;
+      int j;
+      for (i = 0; i < r.height; ++i) {
+        const color_t* from = image->pixels + (r.y + i) * image->width + r.x;
+        char* to = (char*)(img) + (y + i) * stride + x * bytes_per_pixel;
+        for (j = 0; j < r.width; ++j, to += bytes_per_pixel) {
+          if (from[j] == image->color_key) continue;
+          format->put(to, native_pixel(from[j]));
+        }
+        mark_drawn(buf, y + i, x, x + r.width - 1);
+      }
+    }
+    STATS_ADD(pixels, (long long)(r.width) * r.height);
+  }
+  STATS_ADD(draw_calls, 1);
+  STATS_ADD(primitives, 1);
+  STATS_TIME(draw_ns, start);
+}
+
+/**
+ * An offscreen buffer composited over the back buffer. Pixels of the color
+ * key, by default 0 like cleared pixels, are transparent and the others are
+ * blended with the layer alpha, times the alpha plane if there is one.
+ */
+struct layer {
+  void* img;
+  int alpha;  // 0 to 256.
+  int color_key;  // RGB565 color left transparent, or NO_COLOR_KEY.
+  uint8_t* alpha_plane;  // line_length * line_count bytes, or NULL.
+};
+
+static struct layer layers[MAX_LAYERS];  // From the bottom up.
+static int layer_count;
+
+static struct layer* find_layer(void* img) {
+  int i;
+  for (i = 0; i < layer_count; ++i) {
+    if (layers[i].img == img) return &layers[i];
+  }
+  return NULL;
+}
+
+static void remove_layer(struct layer* layer) {
+  free(layer->alpha_plane);
+  memmove(layer, layer + 1,
+          (char*)(&layers[layer_count]) - (char*)(layer + 1));
+  --layer_count;
+}
+
+static void drop_layers() {
+  while (layer_count > 0) remove_layer(&layers[layer_count - 1]);
+}
+
+int add_layer(void* img, int alpha) {
+  if (!initialized || !img || is_tiled(img)) return -1;
+  struct layer* layer = find_layer(img);
+  if (layer) remove_layer(layer);
+  if (layer_count == MAX_LAYERS) return -1;
+  layer = &layers[layer_count++];
+  layer->img = img;
+  layer->alpha_plane = NULL;
+  layer->color_key = 0;
+  set_layer_alpha(img, alpha);
+  return 0;
+}
+
+void drop_layer(void* img) {
+  struct layer* layer = find_layer(img);
+  if (layer) remove_layer(layer);
+}
+
+void set_layer_alpha(void* img, int alpha) {
+  struct layer* layer = find_layer(img);
+  if (!layer) return;
+  if (alpha < 0) alpha = 0;
+  if (alpha > 255) alpha = 255;
+  layer->alpha = alpha + (alpha >> 7);
+}
+
+void set_layer_color_key(void* img, int color_key) {
+  struct layer* layer = find_layer(img);
+  if (layer) layer->color_key = color_key;
+}
+
+unsigned char* get_layer_alpha_plane(void* img) {
+  struct layer* layer = find_layer(img);
+  if (!layer) return NULL;
+  if (!layer->alpha_plane) {
+    layer->alpha_plane = calloc((size_t)(line_length) * line_count, 1);
+  }
+  return layer->alpha_plane;
+}
+
+/** Blends pixels of any native format by channel, for non-RGB565 screens. */
+static void blend_native(char* dst, const char* src, const uint8_t* alpha,
+                         int scale, int key, int count) {
+  const struct fb_bitfield* channels[3] = {
+    &var_info.red, &var_info.green, &var_info.blue
+  };
+  const uint32_t native_key = key == NO_COLOR_KEY ? 0 : native_pixel(key);
+  int i;
+  int c;
+  for (i = 0; i < count; ++i, dst += bytes_per_pixel, src += bytes_per_pixel) {
+    uint32_t s = 0;
+    uint32_t d = 0;
+    memcpy(&s, src, bytes_per_pixel);
+    memcpy(&d, dst, bytes_per_pixel);
+    if (key != NO_COLOR_KEY && s == native_key) continue;
+    int a = pixel_alpha(alpha, i, scale);
+    uint32_t out = 0;
+    for (c = 0; c < 3; ++c) {
+      uint32_t mask = (1u << channels[c]->length) - 1;
+      uint32_t sc = (s >> channels[c]->offset) & mask;
+      uint32_t dc = (d >> channels[c]->offset) & mask;
+      out |= ((sc * a + dc * (256 - a) + 128) >> 8) << channels[c]->offset;
+    }
+    format->put(dst, out);
+  }
+}
+
+/** Whether every per-pixel alpha in a block of the plane is zero. */
+static bool plane_clear(const uint8_t* plane, int x0, int x1, int y0, int y1) {
+  int y;
+  for (y = y0; y <= y1; ++y) {
+    const uint8_t* row = plane + (size_t)(y) * line_length;
+    int x = x0;
+    uint64_t bits = 0;
+    for (; x + 8 <= x1 + 1; x += 8) {
+      uint64_t word;
+      memcpy(&word, row + x, 8);
+      bits |= word;
+    }
+    for (; x <= x1; ++x) bits |= row[x];
+    if (bits) return false;
+  }
+  return true;
+}
+
+/**
+ * The damage of a layer whose undrawn pixels are transparent, or NULL. Pixels
+ * outside the used damage are 0, so they can be skipped when 0 is the key.
+ */
+static const struct damage* layer_used(const struct layer* layer,
+                                       const struct buffer* buf) {
+  if (!buf || layer->alpha_plane || layer->color_key != 0) return NULL;
+  return &buf->used;
+}
+
+/** Whether a tile of the layer may have visible pixels. */
+static bool tile_visible(const struct layer* layer, const struct damage* used,
+                         int x0, int x1, int y0, int y1) {
+  int y;
+  if (layer->alpha_plane) {
+    return !plane_clear(layer->alpha_plane, x0, x1, y0, y1);
+  }
+  if (!used) return true;
+  for (y = y0; y <= y1; ++y) {
+    if (used->min_x[y] <= x1 && used->max_x[y] >= x0) return true;
+  }
+  return false;
+}
+
+/** Blends a layer into dst, one run of visible tiles at a time. */
+static long long composite_layer(const struct layer* layer, char* dst,
+                                 struct buffer* dst_buf) {
+  const int tile = 1 << TILE_SHIFT;
+  const struct damage* used = layer_used(layer, find_buffer(layer->img));
+  const char* src = layer->img;
+  long long blended = 0;
+  int ty;
+  if (layer->alpha == 0) return 0;
+  for (ty = 0; ty < line_count; ty += tile) {
+    int y1 = ty + tile - 1 < line_count ? ty + tile - 1 : line_count - 1;
+    if (used && (used->top > y1 || used->bottom < ty)) continue;
+    int tx = 0;
+    while (tx < line_length) {
+      int run_start = tx;
+      // Extend the run over consecutive visible tiles.
+      while (tx < line_length &&
+             tile_visible(layer, used, tx,
+                          tx + tile - 1 < line_length ? tx + tile - 1 :
+                              line_length - 1, ty, y1)) {
+        tx += tile;
+      }
+      int run_end = tx < line_length ? tx : line_length;
+      if (run_end == run_start) {
+        tx += tile;
+        continue;
+      }
+      int y;
+      for (y = ty; y <= y1; ++y) {
+        int x0 = run_start;
+        int x1 = run_end - 1;
+        // Within the run, only the pixels drawn on this row can be visible.
+        if (used) {
+          if (used->min_x[y] > x0) x0 = used->min_x[y];
+          if (used->max_x[y] < x1) x1 = used->max_x[y];
+          if (x0 > x1) continue;
+        }
+        size_t offset = y * stride + x0 * bytes_per_pixel;
+        const uint8_t* alpha = layer->alpha_plane ?
+            layer->alpha_plane + (size_t)(y) * line_length + x0 : NULL;
+        if (native_rgb565) {
+          blend_kernel((uint16_t*)(dst + offset),
+                       (const uint16_t*)(src + offset), alpha, layer->alpha,
+                       layer->color_key, x1 - x0 + 1);
+        } else {
+          blend_native(dst + offset, src + offset, alpha, layer->alpha,
+                       layer->color_key, x1 - x0 + 1);
+        }
+        mark_drawn(dst_buf, y, x0, x1);
+        blended += x1 - x0 + 1;
+      }
+    }
+  }
+  return blended;
+}
+
+void composite_layers(void* dst) {
+  if (!initialized || !dst || is_tiled(dst)) return;
+  render_sync();
+  long long start = stats_start();
+  struct buffer* dst_buf = find_buffer(dst);
+  long long blended = 0;
+  int i;
+  for (i = 0; i < layer_count; ++i) {
+    if (layers[i].img == dst) continue;
+    blended += composite_layer(&layers[i], dst, dst_buf);
+  }
+  STATS_ADD(draw_calls, 1);
+  STATS_ADD(primitives, layer_count);
+  STATS_ADD(pixels, blended);
+  STATS_TIME(draw_ns, start);
+}
+
+static int compare_intervals(const void* a, const void* b) {
+  unsigned long long x = *(const unsigned long long*)(a);
+  unsigned long long y = *(const unsigned long long*)(b);
+  return (x > y) - (x < y);
+}
+
+void get_graphics_stats(struct graphics_stats* out) {
+  static unsigned long long sorted[FRAME_RING_SIZE];
+  unsigned i;
+  memset(out, 0, sizeof(*out));
+#define LOAD_COUNTER(counter) \
+  out->counter = __atomic_load_n(&stats.counter, __ATOMIC_RELAXED)
+  LOAD_COUNTER(frames);
+  LOAD_COUNTER(clears);
+  LOAD_COUNTER(clear_ns);
+  LOAD_COUNTER(draw_calls);
+  LOAD_COUNTER(primitives);
+  LOAD_COUNTER(pixels);
+  LOAD_COUNTER(draw_ns);
+  LOAD_COUNTER(bytes_blitted);
+  LOAD_COUNTER(blit_ns);
+  LOAD_COUNTER(frames_queued);
+  LOAD_COUNTER(queue_depth_sum);
+  LOAD_COUNTER(queue_wait_ns);
+  LOAD_COUNTER(capture_bytes);
+  LOAD_COUNTER(capture_ns);
+  LOAD_COUNTER(terminal_bytes);
+  for (i = 0; i < GRAPHICS_STATS_BUCKETS; ++i) LOAD_COUNTER(frame_histogram[i]);
+#undef LOAD_COUNTER
+  unsigned count = __atomic_load_n(&frame_ring_next, __ATOMIC_RELAXED);
+  if (count > FRAME_RING_SIZE) count = FRAME_RING_SIZE;
+  for (i = 0; i < count; ++i) {
+    sorted[i] = __atomic_load_n(&frame_ring[i], __ATOMIC_RELAXED);
+  }
+  if (count == 0) return;
+  qsort(sorted, count, sizeof(sorted[0]), compare_intervals);
+  out->frame_p50_ns = sorted[(count - 1) / 2];
+  out->frame_p99_ns = sorted[(count - 1) * 99 / 100];
+  out->frame_max_ns = sorted[count - 1];
+}
+
+void reset_graphics_stats() {
+  render_sync();
+  memset(&stats, 0, sizeof(stats));
+  __atomic_store_n(&frame_ring_next, 0, __ATOMIC_RELAXED);
+  last_frame_ns = 0;
+}
+
+/** Prints the stats to standard error. */
+static void dump_stats() {
+  struct graphics_stats s;
+  int i;
+  get_graphics_stats(&s);
+  fprintf(stderr,
+          "graphics: %llu frames, %llu clears in %.3f ms, "
+          "%llu draw calls (%llu primitives, %llu pixels) in %.3f ms, "
+          "%llu bytes blitted in %.3f ms\n",
+          s.frames, s.clears, s.clear_ns / 1e6, s.draw_calls, s.primitives,
+          s.pixels, s.draw_ns / 1e6, s.bytes_blitted, s.blit_ns / 1e6);
+  fprintf(stderr, "graphics: frame interval p50 %.3f ms, p99 %.3f ms, "
+          "max %.3f ms\n", s.frame_p50_ns / 1e6, s.frame_p99_ns / 1e6,
+          s.frame_max_ns / 1e6);
+  if (s.frames_queued) {
+    fprintf(stderr, "graphics: %llu frames queued, mean queue depth %.2f, "
+            "%.3f ms waiting for the present thread\n", s.frames_queued,
+            (double)(s.queue_depth_sum) / s.frames_queued,
+            s.queue_wait_ns / 1e6);
+  }
+  if (s.capture_bytes) {
+    fprintf(stderr, "graphics: %llu bytes captured in %.3f ms\n",
+            s.capture_bytes, s.capture_ns / 1e6);
+  }
+  if (s.terminal_bytes) {
+    fprintf(stderr, "graphics: %llu bytes sent to the terminal, %.0f per "
+            "frame\n", s.terminal_bytes,
+            s.frames ? (double)(s.terminal_bytes) / s.frames : 0.0);
+  }
+  for (i = 0; i < GRAPHICS_STATS_BUCKETS; ++i) {
+    if (!s.frame_histogram[i]) continue;
+    fprintf(stderr, "graphics:   < %8llu us: %llu\n", 2ULL << i,
+            s.frame_histogram[i]);
   }
 }
@@ -332,10 +332,13 @@
 #define __NR_fallocate		324
 #define __NR_cs1550_down	325
 #define __NR_cs1550_up		326
+#define __NR_cs1550_semop	327
+#define __NR_cs1550_down_n	328
+#define __NR_cs1550_up_n	329
 
 #ifdef __KERNEL__
 
-#define NR_syscalls 327
+#define NR_syscalls 330
 
 #define __ARCH_WANT_IPC_PARSE_VERSION
 #define __ARCH_WANT_OLD_READDIR
@@ -38,10 +38,14 @@
 #include <linux/syscalls.h>
 #include <linux/kprobes.h>
 #include <linux/user_namespace.h>
+#include <linux/futex.h>
+#include <linux/jhash.h>
+#include <linux/uaccess.h>
 
 #include <asm/uaccess.h>
 #include <asm/io.h>
 #include <asm/unistd.h>
+#include <asm/futex.h>
 
 #ifndef SET_UNALIGN_CTL
 # define SET_UNALIGN_CTL(a,b)	(-EINVAL)
@@ -2358,86 +2362,557 @@ int orderly_poweroff(bool force)
 }
 EXPORT_SYMBOL_GPL(orderly_poweroff);
 
-#ifndef CS1550_SEM_INIT_PL_SIZE
-#define CS1550_SEM_INIT_PL_SIZE 2
+#ifndef CS1550_SEM_HASH_BITS
+#define CS1550_SEM_HASH_BITS 8
 #endif
+#define CS1550_SEM_HASH_SIZE (1 << CS1550_SEM_HASH_BITS)
+// Operations in one cs1550_semop(), each locking a bucket as its own lockdep
+// subclass, of which there are 8.
+#define CS1550_SEMOP_MAX 8
+// Write faults taken on a semaphore before an operation gives up.
+#define CS1550_FAULT_RETRIES 2
+// Give-backs of units already taken retry for as long as the page can be
+// faulted in, since giving up would lose the units for good.
+#define CS1550_GIVE_BACK_RETRIES INT_MAX
+// Units one operation may take or give. Even with every process of a 32-bit
+// pid space asleep on a semaphore, the units owed to them fit in its value.
+#define CS1550_SEM_MAX_DELTA (1 << 15)
 
-/** Spin lock for semaphore critical regions. */
-DEFINE_SPINLOCK(sem_lock);
+/**
+ * Spin locks for semaphore critical regions, with the processes sleeping on
+ * the semaphores. A semaphore is guarded by the lock of the bucket its futex
+ * key hashes to, so unrelated semaphores rarely share a lock, and its
+ * sleepers wait in the queue of that bucket in arrival order. Every bucket
+ * sits on a cache line of its own, so two locks never share one. The locks
+ * and queues live in the kernel, and no memory is allocated per semaphore.
+ */
+static struct cs1550_sem_bucket {
+  spinlock_t lock;
+  struct list_head waiters;
+} ____cacheline_aligned_in_smp cs1550_sem_buckets[CS1550_SEM_HASH_SIZE];
+
+static int __init cs1550_sem_init(void)
+{
+  int i;
+  for (i = 0; i < CS1550_SEM_HASH_SIZE; ++i) {
+    spin_lock_init(&cs1550_sem_buckets[i].lock);
+    INIT_LIST_HEAD(&cs1550_sem_buckets[i].waiters);
+  }
+  return 0;
+}
+core_initcall(cs1550_sem_init);
 
 /**
  * The data type containing the value of a semaphore denoting the amount of
- * available resource, and a list of processes that has been put to sleep.
+ * available resource. A negative value is the number of units owed to the
+ * processes put to sleep. User space takes and returns units itself with
+ * compare-and-swap while the value stays non-negative, and only enters the
+ * kernel to sleep or to wake a sleeper, so the kernel changes the value
+ * atomically too.
  */
 struct cs1550_sem
 {
   int value;
-  int pl_size;  // The capacity of the process list queue.
-  int pl_head;  // The head index of the process list queue.
-  struct task_struct **pl;  // Process list queue implemented as a dynamic array.
 };
 
 /**
- * "cs1550_down()" is the custom implementation of a semaphore's down operation
- * as introduced in Professor Misurda's CS 1550 course at the University of
- * Pittsburgh. The down operation is semantically identical to wait.
- * It decreases the amount of available resource by one, and adds a process to a
- * process list and put it to sleep when there is no resource available.
+ * An operation of cs1550_semop(). A negative delta takes -delta units of the
+ * semaphore, and a positive one gives delta units back.
  */
-asmlinkage long sys_cs1550_down(struct cs1550_sem *sem)
+struct cs1550_sem_op
+{
+  struct cs1550_sem *sem;
+  int delta;
+};
+
+/** An operation being applied, with the bucket of its semaphore. */
+struct cs1550_pending_op
+{
+  struct cs1550_sem *sem;
+  int delta;
+  union futex_key key;
+  struct cs1550_sem_bucket *bucket;
+};
+
+/**
+ * A process sleeping on a semaphore. It lives on the stack of the sleeper,
+ * so queueing never allocates. Units given back to the semaphore are handed
+ * to its sleepers in arrival order, and a sleeper is unlinked and woken by
+ * whoever hands it the last unit it needs.
+ */
+struct cs1550_waiter
 {
+  struct list_head link;  // In the waiters of the bucket.
+  union futex_key key;  // The semaphore slept on.
+  struct task_struct *task;
+  int need;  // Units still owed to the sleeper.
+};
+
+/** The distinct bucket locks of an operation, in address order. */
+struct cs1550_locks
+{
+  struct cs1550_sem_bucket *buckets[CS1550_SEMOP_MAX];
+  int count;
+};
+
+/**
+ * Finds the bucket of a semaphore and its futex key, or returns NULL if the
+ * address is not a valid semaphore. The futex key names the memory of the
+ * semaphore rather than its virtual address, so processes sharing the
+ * semaphore through a shared mapping find the same bucket wherever they
+ * mapped it. A reference on the key is taken, as futex_wait() does, so that
+ * the memory it names cannot be freed and reused while a sleeper waits on
+ * it; cs1550_put_ops() drops it.
+ */
+static struct cs1550_sem_bucket *cs1550_sem_bucket(struct cs1550_sem *sem,
+                                                   union futex_key *key)
+{
+  struct rw_semaphore *fshared = &current->mm->mmap_sem;
+  u32 hash;
+  int err;
+  // A non-NULL fshared asks for a shared key, held across the lookup.
+  down_read(fshared);
+  err = get_futex_key((u32 __user *)&sem->value, fshared, key);
+  if (!err) {
+    get_futex_key_refs(key);
+  }
+  up_read(fshared);
+  if (err) {
+    return NULL;
+  }
+  hash = jhash2((u32 *)&key->both.word,
+                (sizeof(key->both.word) + sizeof(key->both.ptr)) / 4,
+                key->both.offset);
+  return &cs1550_sem_buckets[hash & (CS1550_SEM_HASH_SIZE - 1)];
+}
+
+static int cs1550_same_key(const union futex_key *a, const union futex_key *b)
+{
+  return a->both.word == b->both.word && a->both.ptr == b->both.ptr &&
+      a->both.offset == b->both.offset;
+}
+
+/**
+ * Adds an operation to ops, merging it with an earlier down or up on the same
+ * semaphore as itself. Returns -EINVAL if the semaphore is not valid or the
+ * delta, merged or not, is above CS1550_SEM_MAX_DELTA.
+ */
+static int cs1550_prepare_op(struct cs1550_pending_op *ops, int *count,
+                             struct cs1550_sem *sem, int delta)
+{
+  struct cs1550_pending_op *op = &ops[*count];
   int i;
-  spin_lock(&sem_lock);
-  // Expand the process list capacity when necessary.
-  if (sem->value == -sem->pl_size) {
-    struct task_struct **new_pl;
-    int new_pl_size = sem->pl_size == 0 ?
-        CS1550_SEM_INIT_PL_SIZE : sem->pl_size * 2;
-    new_pl = kmalloc(sizeof(void *) * new_pl_size, GFP_KERNEL);
-    // Copy existing processes.
-    for (i = 0; i < sem->pl_size; ++i) {
-      *(new_pl + i) = *(sem->pl + ((sem->pl_head + i) % sem->pl_size));
+  if (delta < -CS1550_SEM_MAX_DELTA || delta > CS1550_SEM_MAX_DELTA) {
+    return -EINVAL;
+  }
+  op->bucket = cs1550_sem_bucket(sem, &op->key);
+  if (!op->bucket) {
+    return -EINVAL;
+  }
+  for (i = 0; i < *count; ++i) {
+    // A down and an up are kept apart, since the down is taken first.
+    if (cs1550_same_key(&ops[i].key, &op->key) &&
+        (ops[i].delta < 0) == (delta < 0)) {
+      drop_futex_key_refs(&op->key);
+      ops[i].delta += delta;
+      if (ops[i].delta < -CS1550_SEM_MAX_DELTA ||
+          ops[i].delta > CS1550_SEM_MAX_DELTA) {
+        return -EINVAL;
+      }
+      return 0;
+    }
+  }
+  op->sem = sem;
+  op->delta = delta;
+  ++*count;
+  return 0;
+}
+
+/** Drops the key references of prepared operations. Might sleep. */
+static void cs1550_put_ops(struct cs1550_pending_op *ops, int count)
+{
+  int i;
+  for (i = 0; i < count; ++i) {
+    drop_futex_key_refs(&ops[i].key);
+  }
+}
+
+/**
+ * Takes the bucket locks in address order, so that operations sharing
+ * buckets cannot deadlock, each as its own lockdep subclass.
+ */
+static void cs1550_lock(struct cs1550_locks *locks)
+{
+  int i;
+  for (i = 0; i < locks->count; ++i) {
+    spin_lock_nested(&locks->buckets[i]->lock, i);
+  }
+}
+
+static void cs1550_unlock(struct cs1550_locks *locks)
+{
+  int i;
+  for (i = locks->count - 1; i >= 0; --i) {
+    spin_unlock(&locks->buckets[i]->lock);
+  }
+}
+
+/**
+ * Faults in the page of a semaphore for writing, as futex_handle_fault()
+ * does. A read fault would leave a read-only or copy-on-write page as it is,
+ * and the swap would fault again. Called without the bucket locks. Returns 0,
+ * or -EFAULT if the semaphore is not in writable memory.
+ */
+static int cs1550_fault_in_writeable(int __user *uaddr)
+{
+  unsigned long address = (unsigned long)uaddr;
+  struct mm_struct *mm = current->mm;
+  struct vm_area_struct *vma;
+  int ret = -EFAULT;
+  int fault;
+  down_read(&mm->mmap_sem);
+  vma = find_vma(mm, address);
+  if (vma && address >= vma->vm_start && (vma->vm_flags & VM_WRITE)) {
+    fault = handle_mm_fault(mm, vma, address, 1);
+    if (!(fault & VM_FAULT_ERROR)) {
+      ret = 0;
+      if (fault & VM_FAULT_MAJOR) {
+        current->maj_flt++;
+      } else {
+        current->min_flt++;
+      }
+    }
+  }
+  up_read(&mm->mmap_sem);
+  return ret;
+}
+
+/**
+ * Adds delta to the value of a semaphore with compare-and-swap unless that
+ * would take the value below floor, storing the value before in *old.
+ * Returns 0, -EOVERFLOW if the value would overflow, or -EFAULT if the
+ * semaphore is not in writable memory. Called with the bucket locks held, so
+ * faults are not taken in place; the locks are dropped to fault the page in
+ * for writing, and the swap retried up to retries times.
+ */
+static int cs1550_sem_add(struct cs1550_locks *locks, struct cs1550_sem *sem,
+                          int delta, int floor, int *old, int retries)
+{
+  int __user *uaddr = (int __user *)&sem->value;
+  int value, prev, now, err;
+  int attempt = 0;
+  while (1) {
+    pagefault_disable();
+    err = __copy_from_user_inatomic(&value, uaddr, sizeof(value)) ? -EFAULT : 0;
+    prev = value;
+    if (!err &&
+        (delta > 0 ? value > INT_MAX - delta : value < INT_MIN - delta)) {
+      err = -EOVERFLOW;
+    } else if (!err && delta != 0 && value + delta >= floor) {
+      prev = futex_atomic_cmpxchg_inatomic(uaddr, value, value + delta);
+      // -EFAULT is also an old value the swap can return. Negative values
+      // only change under the bucket lock, so the value read back tells a
+      // swap from a fault.
+      if (prev == -EFAULT) {
+        if (value == -EFAULT &&
+            !__copy_from_user_inatomic(&now, uaddr, sizeof(now)) &&
+            now == value + delta) {
+          prev = value;
+        } else {
+          err = -EFAULT;
+        }
+      }
+    }
+    pagefault_enable();
+    if (err == -EOVERFLOW) {
+      return err;
+    }
+    if (!err) {
+      if (prev == value) {
+        *old = value;
+        return 0;
+      }
+      continue;  // User space changed the value first.
+    }
+    if (attempt++ == retries) {
+      return -EFAULT;
     }
-    if (sem->pl) {
-      kfree(sem->pl);
+    cs1550_unlock(locks);
+    err = cs1550_fault_in_writeable(uaddr);
+    cs1550_lock(locks);
+    if (err) {
+      return -EFAULT;
     }
-    sem->pl_size = new_pl_size;
-    sem->pl_head = 0;
-    sem->pl = new_pl;
   }
-  // Main logic.
-  if (--sem->value < 0) {
-    *(sem->pl + ((sem->pl_head - sem->value - 1) % sem->pl_size)) = current;
-    set_current_state(TASK_INTERRUPTIBLE);
-    spin_unlock(&sem_lock);
-    schedule();
-  } else {
-    spin_unlock(&sem_lock);
+}
+
+/**
+ * Gives count units back to a semaphore. Those owed to its sleepers are
+ * handed to them in arrival order, waking each sleeper that got all it needs.
+ */
+static int cs1550_give(struct cs1550_locks *locks,
+                       struct cs1550_pending_op *op, int count, int retries)
+{
+  struct cs1550_waiter *waiter, *next;
+  int old, granted;
+  int err = cs1550_sem_add(locks, op->sem, count, INT_MIN, &old, retries);
+  if (err) {
+    return err;
+  }
+  if (count > -old) {
+    count = -old;
+  }
+  list_for_each_entry_safe(waiter, next, &op->bucket->waiters, link) {
+    if (count <= 0) {
+      break;
+    }
+    if (!cs1550_same_key(&waiter->key, &op->key)) {
+      continue;
+    }
+    granted = count < waiter->need ? count : waiter->need;
+    waiter->need -= granted;
+    count -= granted;
+    if (waiter->need == 0) {
+      // The sleeper cannot return before it retakes the lock.
+      list_del(&waiter->link);
+      wake_up_process(waiter->task);
+    }
   }
   return 0;
 }
 
+/**
+ * Takes a sleeper interrupted by a signal off the queue of the down it slept
+ * on, dropping the units it is still owed and giving back those it got. Both
+ * are attempted even if the other fails, and the first error is returned.
+ */
+static int cs1550_cancel(struct cs1550_locks *locks,
+                         struct cs1550_pending_op *op,
+                         struct cs1550_waiter *waiter)
+{
+  int old, err, give_err;
+  list_del(&waiter->link);
+  err = cs1550_sem_add(locks, op->sem, waiter->need, INT_MIN, &old,
+                       CS1550_GIVE_BACK_RETRIES);
+  give_err = cs1550_give(locks, op, -op->delta - waiter->need,
+                         CS1550_GIVE_BACK_RETRIES);
+  return err ? err : give_err;
+}
+
+/**
+ * Applies operations on up to CS1550_SEMOP_MAX semaphores together. The
+ * units of all the downs are taken at once, sleeping until that is possible,
+ * and then the ups give theirs back and wake the sleepers they are owed to.
+ * A process that cannot take them all queues up for the first semaphore
+ * short of units and holds no units of the others while it sleeps, so the
+ * downs of different calls cannot deadlock. A signal ends the sleep with no
+ * operation applied and -ERESTARTSYS, so the call is restarted after a stop
+ * or a handler with SA_RESTART, and fails with -EINTR otherwise. The key
+ * references of the operations are dropped on return.
+ */
+static long cs1550_semop(struct cs1550_pending_op *ops, int count)
+{
+  struct cs1550_locks locks;
+  struct cs1550_waiter waiter;
+  int held = -1;  // The down whose units were handed over during a sleep.
+  int failed, old, err, i, j;
+  long ret = 0;
+  locks.count = 0;
+  for (i = 0; i < count; ++i) {
+    struct cs1550_sem_bucket *bucket = ops[i].bucket;
+    for (j = 0; j < locks.count && locks.buckets[j] < bucket; ++j) {
+    }
+    if (j < locks.count && locks.buckets[j] == bucket) {
+      continue;
+    }
+    memmove(&locks.buckets[j + 1], &locks.buckets[j],
+            (locks.count - j) * sizeof(locks.buckets[0]));
+    locks.buckets[j] = bucket;
+    ++locks.count;
+  }
+  cs1550_lock(&locks);
+  while (1) {
+    // Take the downs that have enough units, until one does not.
+    failed = -1;
+    for (i = 0; i < count && failed < 0; ++i) {
+      if (ops[i].delta >= 0 || i == held) {
+        continue;
+      }
+      ret = cs1550_sem_add(&locks, ops[i].sem, ops[i].delta, 0, &old,
+                           CS1550_FAULT_RETRIES);
+      if (ret || old + ops[i].delta < 0) {
+        failed = i;
+      }
+    }
+    if (failed < 0) {
+      break;
+    }
+    // Give back every unit taken before reporting an error.
+    for (j = 0; j < failed; ++j) {
+      if (ops[j].delta < 0 && j != held) {
+        err = cs1550_give(&locks, &ops[j], -ops[j].delta,
+                          CS1550_GIVE_BACK_RETRIES);
+        if (err && !ret) {
+          ret = err;
+        }
+      }
+    }
+    if (held >= 0) {
+      err = cs1550_give(&locks, &ops[held], -ops[held].delta,
+                        CS1550_GIVE_BACK_RETRIES);
+      if (err && !ret) {
+        ret = err;
+      }
+      held = -1;
+    }
+    if (ret) {
+      goto out;
+    }
+    // Queue up for the units of the down that is short of them.
+    ret = cs1550_sem_add(&locks, ops[failed].sem, ops[failed].delta, INT_MIN,
+                         &old, CS1550_FAULT_RETRIES);
+    if (ret) {
+      goto out;
+    }
+    waiter.need = -ops[failed].delta - (old > 0 ? old : 0);
+    if (waiter.need > 0) {
+      waiter.key = ops[failed].key;
+      waiter.task = current;
+      list_add_tail(&waiter.link, &ops[failed].bucket->waiters);
+      while (waiter.need > 0) {
+        if (signal_pending(current)) {
+          ret = cs1550_cancel(&locks, &ops[failed], &waiter);
+          if (!ret) {
+            ret = -ERESTARTSYS;
+          }
+          goto out;
+        }
+        set_current_state(TASK_INTERRUPTIBLE);
+        cs1550_unlock(&locks);
+        schedule();
+        cs1550_lock(&locks);
+      }
+    }
+    held = failed;
+  }
+  for (i = 0; i < count; ++i) {
+    if (ops[i].delta > 0) {
+      err = cs1550_give(&locks, &ops[i], ops[i].delta, CS1550_FAULT_RETRIES);
+      if (err && !ret) {
+        ret = err;
+      }
+    }
+  }
+out:
+  cs1550_unlock(&locks);
+  cs1550_put_ops(ops, count);
+  return ret;
+}
+
+/**
+ * "cs1550_down()" is the custom implementation of a semaphore's down operation
+ * as introduced in Professor Misurda's CS 1550 course at the University of
+ * Pittsburgh. The down operation is semantically identical to wait.
+ * It decreases the amount of available resource by one, and queues the process
+ * and puts it to sleep when there is no resource available. A signal ends the
+ * sleep, giving the unit back, and restarts the call or fails with -EINTR as
+ * for cs1550_semop(). It is the slow path of a down in user space that found
+ * no unit available.
+ */
+asmlinkage long sys_cs1550_down(struct cs1550_sem *sem)
+{
+  struct cs1550_pending_op op;
+  int count = 0;
+  if (cs1550_prepare_op(&op, &count, sem, -1)) {
+    return -EINVAL;
+  }
+  return cs1550_semop(&op, count);
+}
+
 /**
  * "cs1550_up()" is the custom implementation of a semaphore's up operation as
  * introduced introduced in Professor Misurda's CS 1550 course at the University
  * of Pittsburgh. The up operation is semantically identical to post.
- * It marks that one more unit of resource as available and wakes up a process
- * by marking it as ready.
+ * It marks that one more unit of resource as available and wakes up the
+ * process that has slept the longest by marking it as ready. It is the slow
+ * path of an up in user space that found sleepers.
  */
 asmlinkage long sys_cs1550_up(struct cs1550_sem *sem)
 {
-  spin_lock(&sem_lock);
-  // Main logic.
-  if (++sem->value <= 0) {
-    wake_up_process(*(sem->pl + sem->pl_head));
-    sem->pl_head = (sem->pl_head + 1) % sem->pl_size;
+  struct cs1550_pending_op op;
+  int count = 0;
+  if (cs1550_prepare_op(&op, &count, sem, 1)) {
+    return -EINVAL;
   }
-  // Free dynamically allocated space when logical size is 0.
-  if (sem->value == 0 && sem->pl_size > 0) {
-    sem->pl_size = 0;
-    kfree(sem->pl);
-    sem->pl = NULL;
+  return cs1550_semop(&op, count);
+}
+
+/**
+ * "cs1550_down_n()" takes n units of a semaphore at once, sleeping until all
+ * of them are available. The process queues up once for the units it lacks
+ * and holds those it got while it sleeps, so units trickling back one at a
+ * time are not lost to later arrivals. Returns -EINVAL unless n is from 1 to
+ * CS1550_SEM_MAX_DELTA, and -EOVERFLOW if the value would overflow.
+ */
+asmlinkage long sys_cs1550_down_n(struct cs1550_sem *sem, int n)
+{
+  struct cs1550_pending_op op;
+  int count = 0;
+  if (n <= 0 || n > CS1550_SEM_MAX_DELTA ||
+      cs1550_prepare_op(&op, &count, sem, -n)) {
+    return -EINVAL;
   }
-  spin_unlock(&sem_lock);
-  return 0;
+  return cs1550_semop(&op, count);
+}
+
+/**
+ * "cs1550_up_n()" gives n units back to a semaphore at once. They are handed
+ * to the sleepers in the order they went to sleep until they are used up,
+ * waking every sleeper that got all the units it waits for, and the rest
+ * become available. Returns -EINVAL unless n is from 1 to CS1550_SEM_MAX_DELTA,
+ * and -EOVERFLOW if the value would overflow.
+ */
+asmlinkage long sys_cs1550_up_n(struct cs1550_sem *sem, int n)
+{
+  struct cs1550_pending_op op;
+  int count = 0;
+  if (n <= 0 || n > CS1550_SEM_MAX_DELTA ||
+      cs1550_prepare_op(&op, &count, sem, n)) {
+    return -EINVAL;
+  }
+  return cs1550_semop(&op, count);
+}
+
+/**
+ * "cs1550_semop()" applies an array of nops operations on semaphores at once,
+ * like the semop() of System V semaphores. Every down is taken together,
+ * sleeping until all of them can be, and the ups are applied after them, so
+ * a producer can take a slot and the buffer lock, or return both, with one
+ * call. Downs on the same semaphore are merged, and so are ups, but a down is
+ * never offset by an up of the same call: {s, -1}, {s, 1} sleeps while s has
+ * no unit. Returns -EINVAL for more than CS1550_SEMOP_MAX operations, an
+ * invalid semaphore or a delta above CS1550_SEM_MAX_DELTA, and -EOVERFLOW if
+ * a value would overflow.
+ */
+asmlinkage long sys_cs1550_semop(struct cs1550_sem_op __user *uops,
+                                 unsigned int nops)
+{
+  struct cs1550_pending_op ops[CS1550_SEMOP_MAX];
+  struct cs1550_sem_op op;
+  int count = 0;
+  unsigned int i;
+  if (nops == 0 || nops > CS1550_SEMOP_MAX) {
+    return -EINVAL;
+  }
+  for (i = 0; i < nops; ++i) {
+    if (copy_from_user(&op, uops + i, sizeof(op))) {
+      cs1550_put_ops(ops, count);
+      return -EFAULT;
+    }
+    if (cs1550_prepare_op(ops, &count, op.sem, op.delta)) {
+      cs1550_put_ops(ops, count);
+      return -EINVAL;
+    }
+  }
+  return cs1550_semop(ops, count);
 }
@@ -4,6 +4,7 @@
  * Author: Zac Yu (zhy46@pitt.edu)
  */
 
+#include <errno.h>
 #include <linux/unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,22 +16,137 @@
 #define MAKE_SEM(sem, val) struct cs1550_sem *sem = \
           mmap(NULL, sizeof(struct cs1550_sem), PROT_READ | PROT_WRITE,\
                MAP_SHARED | MAP_ANONYMOUS, 0, 0);\
-          sem->value = val, sem->pl_size = sem->pl_head = 0, sem->pl = NULL
-#define SEM_DOWN(sem) syscall(__NR_cs1550_down, sem)
-#define SEM_UP(sem) syscall(__NR_cs1550_up, sem)
+          sem->value = val
+#define SEM_DOWN(sem) sem_down_n(sem, 1)
+#define SEM_UP(sem) sem_up_n(sem, 1)
+#define SEM_OPS(ops) sem_op(ops, sizeof(ops) / sizeof(ops[0]))
 #define ASSERT_POSITIVITY(val) if (val < 1) {\
           fprintf(stderr, "Argument %s must be a positive integer.\n", #val);\
           return EXIT_FAILURE;\
         }
+#define ASSERT_SEM(call) if ((call) < 0) {\
+          perror(#call);\
+          exit(EXIT_FAILURE);\
+        }
 
 
 struct cs1550_sem {
   int value;
-  int pl_size;
-  int pl_head;
-  void **pl;
 };
 
+/**
+ * An operation of the cs1550_semop() syscall. A negative delta takes -delta
+ * units of the semaphore, and a positive one gives delta units back.
+ */
+struct cs1550_sem_op {
+  struct cs1550_sem *sem;
+  int delta;
+};
+
+/**
+ * Takes n units of a semaphore with compare-and-swap if it has them. Only the
+ * kernel moves the value below zero, where it counts the units owed to
+ * sleepers. Returns whether the units were taken.
+ */
+int sem_try_take(struct cs1550_sem *sem, int n) {
+  int value = sem->value;
+  while (value >= n) {
+    int prev = __sync_val_compare_and_swap(&sem->value, value, value - n);
+    if (prev == value) {
+      return 1;
+    }
+    value = prev;
+  }
+  return 0;
+}
+
+/**
+ * Gives n units back to a semaphore with compare-and-swap unless a process
+ * sleeps on it and the kernel has to hand them over. Returns whether the
+ * units were given.
+ */
+int sem_try_give(struct cs1550_sem *sem, int n) {
+  int value = sem->value;
+  while (value >= 0) {
+    int prev = __sync_val_compare_and_swap(&sem->value, value, value + n);
+    if (prev == value) {
+      return 1;
+    }
+    value = prev;
+  }
+  return 0;
+}
+
+/**
+ * Makes a semaphore syscall, again if a signal handler interrupted its sleep.
+ * The kernel restarts it by itself after a stop or a handler with SA_RESTART.
+ */
+long sem_syscall(long number, const void *arg, int n) {
+  long ret;
+  do {
+    ret = syscall(number, arg, n);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+/**
+ * Takes n units of a semaphore, in user space while they are available. The
+ * kernel is only entered to sleep.
+ */
+long sem_down_n(struct cs1550_sem *sem, int n) {
+  if (sem_try_take(sem, n)) {
+    return 0;
+  }
+  return sem_syscall(__NR_cs1550_down_n, sem, n);
+}
+
+/**
+ * Returns n units to a semaphore, in user space unless processes sleep on it
+ * and the kernel has to hand the units over and wake them.
+ */
+long sem_up_n(struct cs1550_sem *sem, int n) {
+  if (sem_try_give(sem, n)) {
+    return 0;
+  }
+  return sem_syscall(__NR_cs1550_up_n, sem, n);
+}
+
+/**
+ * Applies nops semaphore operations together: the downs all at once, sleeping
+ * until that is possible, then the ups. Without contention it stays in user
+ * space. Otherwise the downs are left to one cs1550_semop() syscall, and the
+ * ups that have to wake sleepers share one too. Returns -1 with errno set if
+ * a syscall fails.
+ */
+long sem_op(const struct cs1550_sem_op *ops, int nops) {
+  struct cs1550_sem_op slow[nops];
+  int nslow = 0;
+  int i, j;
+  for (i = 0; i < nops; ++i) {
+    if (ops[i].delta < 0 && !sem_try_take(ops[i].sem, -ops[i].delta)) {
+      break;
+    }
+  }
+  if (i < nops) {  // Give back what was taken and let the kernel do it all.
+    for (j = 0; j < i; ++j) {
+      if (ops[j].delta < 0 && !sem_try_give(ops[j].sem, -ops[j].delta)) {
+        slow[nslow].sem = ops[j].sem;
+        slow[nslow++].delta = -ops[j].delta;
+      }
+    }
+    if (nslow > 0 && sem_syscall(__NR_cs1550_semop, slow, nslow) < 0) {
+      return -1;
+    }
+    return sem_syscall(__NR_cs1550_semop, ops, nops);
+  }
+  for (i = 0; i < nops; ++i) {
+    if (ops[i].delta > 0 && !sem_try_give(ops[i].sem, ops[i].delta)) {
+      slow[nslow++] = ops[i];
+    }
+  }
+  return nslow > 0 ? sem_syscall(__NR_cs1550_semop, slow, nslow) : 0;
+}
+
 /**
  * Construct the corresponding string index of an non-negative integer with the
  * following pattern (similar to the column name rule of Microsoft Excel):
@@ -88,14 +204,14 @@ int main(int argc, char *argv[]) {
   for (i = 0; i < consumer_num; ++i) {
     char *customer_id = get_alphabetical_index(i);
     if (fork() == 0) {  // Child process.
+      struct cs1550_sem_op take[] = {{full, -1}, {mutex, -1}};
+      struct cs1550_sem_op give[] = {{mutex, 1}, {empty, 1}};
       while (1) {
-        SEM_DOWN(full);
-        SEM_DOWN(mutex);
+        ASSERT_SEM(SEM_OPS(take));
         printf("Customer %s Consumed: Pancake%u\n", customer_id,
                *(buffer_ptr + *consumer_buffer_idx));
         *consumer_buffer_idx = (*consumer_buffer_idx + 1) % buffer_size;
-        SEM_UP(mutex);
-        SEM_UP(empty);
+        ASSERT_SEM(SEM_OPS(give));
       }
     }
   }
@@ -103,15 +219,15 @@ int main(int argc, char *argv[]) {
   for (i = 0; i < producer_num; ++i) {
     char *chef_id = get_alphabetical_index(i);
     if (fork() == 0) {  // Child process.
+      struct cs1550_sem_op take[] = {{empty, -1}, {mutex, -1}};
+      struct cs1550_sem_op give[] = {{mutex, 1}, {full, 1}};
       while (1) {
-        SEM_DOWN(empty);
-        SEM_DOWN(mutex);
+        ASSERT_SEM(SEM_OPS(take));
         *(buffer_ptr + *producer_buffer_idx) = (*next_pancake_idx)++;
         printf("Chef %s Produced: Pancake%u\n", chef_id,
                *(buffer_ptr + *producer_buffer_idx));
         *producer_buffer_idx = (*producer_buffer_idx + 1) % buffer_size;
-        SEM_UP(mutex);
-        SEM_UP(full);
+        ASSERT_SEM(SEM_OPS(give));
       }
     }
   }
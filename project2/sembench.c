@@ -0,0 +1,86 @@
+/*
+ * Project 2: Semaphore Contention Benchmark
+ * CS 1550 - Fall 2017
+ * Author: Zac Yu (zhy46@pitt.edu)
+ */
+
+#include <linux/unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SEM_DOWN(sem) syscall(__NR_cs1550_down, sem)
+#define SEM_UP(sem) syscall(__NR_cs1550_up, sem)
+#define SEM_STRIDE 64  // Keeps every semaphore on a cache line of its own.
+#define DEFAULT_PROCS 8
+#define DEFAULT_ROUNDS 200000
+
+struct cs1550_sem {
+  int value;
+};
+
+/**
+ * Returns the semaphore of process i. The semaphores are spread SEM_STRIDE
+ * bytes apart in one shared mapping.
+ */
+struct cs1550_sem *get_sem(char *sems, int i) {
+  return (struct cs1550_sem *)(sems + i * SEM_STRIDE);
+}
+
+double now_s() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Runs procs processes that each do rounds uncontended down/up pairs, either
+ * on a semaphore of their own or all on one, and returns the pairs per second.
+ * The semaphores start at procs so that no process ever sleeps, which leaves
+ * only the cost of the kernel entries and of the semaphore locks.
+ */
+double run(char *sems, int procs, int rounds, int shared) {
+  int i, j;
+  double start;
+  for (i = 0; i < procs; ++i) {
+    get_sem(sems, i)->value = procs;
+  }
+  start = now_s();
+  for (i = 0; i < procs; ++i) {
+    if (fork() == 0) {  // Child process.
+      struct cs1550_sem *sem = get_sem(sems, shared ? 0 : i);
+      for (j = 0; j < rounds; ++j) {
+        SEM_DOWN(sem);
+        SEM_UP(sem);
+      }
+      exit(EXIT_SUCCESS);
+    }
+  }
+  for (i = 0; i < procs; ++i) {
+    wait(NULL);
+  }
+  return procs * (double)rounds / (now_s() - start);
+}
+
+int main(int argc, char *argv[]) {
+  int max_procs = argc > 1 ? atoi(argv[1]) : DEFAULT_PROCS;
+  int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+  char *sems;
+  int procs;
+  if (argc > 3 || max_procs < 1 || rounds < 1) {
+    fprintf(stderr, "Usage: sembench [max_procs] [rounds]\n");
+    return EXIT_FAILURE;
+  }
+  sems = mmap(NULL, max_procs * SEM_STRIDE, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+  printf("%6s %18s %18s\n", "procs", "independent ops/s", "shared ops/s");
+  for (procs = 1; procs <= max_procs; procs *= 2) {
+    double independent = run(sems, procs, rounds, 0);
+    double shared = run(sems, procs, rounds, 1);
+    printf("%6d %18.0f %18.0f\n", procs, independent, shared);
+  }
+  return EXIT_SUCCESS;
+}